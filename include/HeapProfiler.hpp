@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The mean number of bytes allocated between heap profile samples. Build with
+// -DMALLOC_SAMPLE_BYTES=0 to turn sampling off.
+#ifndef MALLOC_SAMPLE_BYTES
+#define MALLOC_SAMPLE_BYTES (2 << 20)
+#endif
+
+/**
+ * A sampling heap profiler. Each store counts down the bytes it allocates, and
+ * when the countdown runs out the allocation is sampled: its stack is recorded
+ * in a side table keyed by the pointer, until it's freed. Countdowns are drawn
+ * from an exponential distribution, so every byte allocated is equally likely
+ * to be sampled however the allocations line up, and a sample of `bytes` bytes
+ * stands for bytes / (1 - exp(-bytes / rate)) bytes of live data.
+ *
+ * Sampled items are served as BigAllocs rather than from an arena, so free()
+ * only has to check the table for BigAllocs. At the default rate that costs
+ * one page per couple of megabytes allocated.
+ *
+ * The table has a fixed size and samples that don't fit are dropped.
+ */
+class HeapProfiler {
+public:
+    // The most frames recorded per sample.
+    static constexpr size_t maxDepth = 32;
+
+    // The most samples kept at once.
+    static constexpr size_t maxSamples = 12288;
+
+    /**
+     * The mean number of bytes between samples, or zero if sampling is off.
+     */
+    static size_t sampleBytes();
+
+    /**
+     * Changes the sampling rate. Stores pick it up when they next draw a
+     * countdown.
+     */
+    static void setSampleBytes(size_t bytes);
+
+    /**
+     * Draws the number of bytes to allocate before the next sample, advancing
+     * the caller's random state (which must not be zero).
+     */
+    static int64_t nextSample(uint64_t& state);
+
+    /**
+     * Records the calling thread's stack for a sampled item of `bytes` bytes at
+     * `ptr`. Returns false if it couldn't: the table is full, or we got here
+     * from allocations made while recording or dumping.
+     */
+    static bool record(void* ptr, size_t bytes);
+
+    /**
+     * Drops the sample for `ptr`, which is being freed, storing the size it was
+     * allocated with in `bytes`. Returns false if `ptr` wasn't sampled.
+     */
+    static bool forget(void* ptr, size_t& bytes);
+
+    /**
+     * Whether `ptr` is a live sampled item.
+     */
+    static bool sampled(void* ptr);
+
+    /**
+     * How many sampled items are live.
+     */
+    static size_t samples();
+
+    /**
+     * Writes every live sample to `fd` in collapsed stack format, one line per
+     * sample of its frames from the outermost in, separated by semicolons, and
+     * the bytes it stands for:
+     *
+     *     main;handleRequest;parse;myMalloc 2097152
+     *
+     * This is what flamegraph.pl and pprof's -collapsed output look like.
+     * Frames are symbol names where the dynamic linker knows them (mangled, so
+     * pipe it through c++filt) and otherwise module+offset, for addr2line.
+     * Returns the number of samples written.
+     */
+    static size_t dump(int fd);
+
+    /**
+     * Takes the sample table's lock before a fork(), and drops it in the parent
+     * and the child afterwards, so a child forked while another thread held it
+     * doesn't start out unable to sample or free.
+     */
+    static void lockForFork();
+    static void unlockAfterFork();
+};
@@ -2,14 +2,159 @@
 
 #include <signal.h>
 #include <atomic>
+#include <mutex>
+#include <sys/auxv.h>
 #include <sys/mman.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <HeapProfiler.hpp>
+#include <MallocPolicy.hpp>
+#include <PageMap.hpp>
+#include <PageReserve.hpp>
 
 // You can assume this as your page size. On some OSs (e.g. macOS), 
 // it may in fact be larger and you'll waste memory due to internal 
 // fragmentation as a result, but that's okay for this exercise.
 constexpr size_t pageSize = 4096;
 
+// The most pages a single arena may span, under any policy.
+constexpr size_t maxSpanPages = 8;
+
+// BigAllocs of up to this many pages are medium allocations. Like arena spans,
+// they come out of the PageReserve's page-rounded buckets, so they are served
+// from freed regions instead of costing an mmap and munmap each.
+constexpr size_t maxMediumPages = 32;
+
+static_assert(maxMediumPages >= maxSpanPages, "Arena spans are served from the PageReserve");
+
+// Whether BigAllocs of a huge page or more are aligned to one and madvised
+// MADV_HUGEPAGE so the kernel backs them with transparent huge pages. That
+// costs up to a huge page of address space (not memory) each, so it's opt in:
+// build with -DMALLOC_HUGE_BIGALLOCS=1.
+#ifndef MALLOC_HUGE_BIGALLOCS
+#define MALLOC_HUGE_BIGALLOCS 0
+#endif
+
+// Whether arenas keep a bitmap of their live slots, for myMallocWalkLive()
+// and bulk refills. Keeping it adds a header cache line per arena and a bit
+// flip to every allocation and free, so build with -DMALLOC_SLOT_BITMAP=0 to
+// leave it out.
+#ifndef MALLOC_SLOT_BITMAP
+#define MALLOC_SLOT_BITMAP 1
+#endif
+
+static_assert(!MallocPolicy::hardened || MALLOC_SLOT_BITMAP, "MALLOC_HARDENED checks frees against the slot bitmap");
+
+// How long, in milliseconds, cached empty arenas and free reserved spans sit
+// unused before they are purged.
+#ifndef MALLOC_DECAY_MS
+#define MALLOC_DECAY_MS 1000
+#endif
+
+/**
+ * A cheap monotonic clock in milliseconds for decay. Only used off the hot path.
+ */
+inline uint64_t monotonicMillis() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Reports heap corruption found by the MALLOC_HARDENED checks and stops. As
+ * with MMapObject::dealloc()'s own checks, this raises SIGTRAP so a debugger
+ * breaks right where it was found.
+ */
+[[noreturn]] inline void heapCorruption(const char* what, const void* ptr) {
+    char message[128];
+    int length = snprintf(message, sizeof(message), "mymalloc: %s at %p\n", what, ptr);
+    if(length > 0 && write(STDERR_FILENO, message, length) < 0) {
+        // Nothing more we can do about it.
+    }
+    raise(SIGTRAP);
+    abort();
+}
+
+/**
+ * Scrambles a word, for deriving secrets (splitmix64's finalizer).
+ */
+inline uint64_t mixBits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * A random value fixed for the life of the process, which MALLOC_HARDENED's
+ * secrets and canaries are derived from. It comes from the random bytes the
+ * kernel hands every process, so it costs no syscall.
+ */
+inline uintptr_t heapSecret() {
+    static const uintptr_t secret = [] {
+        uint64_t random[2] = {};
+        const void* bytes = reinterpret_cast<const void*>(getauxval(AT_RANDOM));
+        if(bytes != nullptr) {
+            memcpy(random, bytes, sizeof(random));
+        }
+        return static_cast<uintptr_t>(mixBits(random[0] ^ mixBits(random[1])));
+    }();
+    return secret;
+}
+
+// Size of a cache line. Fields written by other threads are padded out to
+// this so they don't invalidate the owner's hot data.
+constexpr size_t cacheLineSize = 64;
+
+class Arena;
+
+template<typename Policy>
+class BasicArenaStore;
+
+// The store every thread gets, built with the build's policy.
+using ArenaStore = BasicArenaStore<MallocPolicy>;
+
+/**
+ * What arenas and the PageMap know of the store that owns them, whatever its
+ * policy: the stack remote frees hand its retired arenas back on.
+ */
+class ArenaOwner {
+protected:
+    // Lock-free stack of retired arenas that other threads have freed into.
+    // Kept on its own cache line so remote pushes don't bounce the line
+    // holding the store's current arenas.
+    alignas(cacheLineSize) std::atomic<Arena*> m_delayed;
+
+public:
+    /**
+     * Called by another thread that freed the first item of one of our retired
+     * arenas, so we know to look at it again.
+     */
+    void delay(Arena* arena);
+};
+
+/**
+ * A statistics counter written by one thread only, so bumping it needs no
+ * locked instruction, but that any thread can read.
+ */
+class StatCounter {
+    std::atomic<uint64_t> m_value;
+
+public:
+    void add(uint64_t n) {
+        m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t load() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
 class MMapObject {
     // The size of the allocated contiguous pages (i.e. the size passed to mmap)
     size_t m_mmapSize;
@@ -22,7 +167,24 @@ class MMapObject {
     // Thread safe and you can ignore it. It's for tests and seeing how many
     // outstanding pages there are.
     static std::atomic<size_t> s_outstandingPages;
+
+    // How many times we've called mmap and munmap directly, as opposed to
+    // going through the PageReserve.
+    static std::atomic<size_t> s_mmapCalls;
+    static std::atomic<size_t> s_munmapCalls;
 public:
+    // Under MALLOC_HARDENED every object too big for the PageReserve is followed
+    // by a PROT_NONE page, so running off its end faults at once. Smaller ones
+    // go without, since a guard keeps a mapping from merging with its neighbours
+    // and a heap of arenas would soon hit vm.max_map_count; their overflows are
+    // caught by the free list and canary checks instead.
+    static constexpr size_t guardPages = MallocPolicy::hardened ? 1 : 0;
+
+    // The most bytes any object may map. It leaves room to round up to whole
+    // pages and add a guard page without overflowing, and no mmap could give
+    // us more anyway.
+    static constexpr size_t maxSize = (SIZE_MAX / 2) & ~(pageSize - 1);
+
     MMapObject(const MMapObject& other) = delete;
     MMapObject() = delete;
 
@@ -41,36 +203,97 @@ public:
         return m_arenaSize;
     }
 
+    /**
+     * Returns the MMapObject that ptr points into, found through the PageMap.
+     * Every page of an arena is registered, but only one page of a BigAlloc: the
+     * one the pointer it hands out lives in.
+     */
+    static MMapObject* fromPointer(void* ptr) {
+        const PageMap::Entry* entry = PageMap::lookup(ptr);
+        return entry != nullptr ? entry->span : nullptr;
+    }
+
+    /**
+     * The number of pages registered in the PageMap for this object.
+     */
+    size_t registeredPages() {
+        return m_arenaSize != 0 ? pagesFor(m_mmapSize) : 1;
+    }
+
+    /**
+     * The number of pages it takes to hold `size` bytes.
+     */
+    static size_t pagesFor(size_t size) {
+        return (size + pageSize - 1) / pageSize;
+    }
+
     /**
      * This function should call mmap to allocate a contiguous set of pages with
      * the passed size. If the caller is intending to use this region as an arena,
      * they should set arenaSize to the size of its items.
      * 
      * If this is a large allocation, the caller should set arenaSize to 0.
+     *
+     * Arena spans and medium allocations are carved out of the PageReserve when
+     * they fit, so most of them cost no syscalls at all. The object is registered
+     * in the PageMap under the given owner. If `zero` is given, it's set to
+     * whether the pages past the header are known to read as zero.
      */
-    static MMapObject* alloc(size_t size, size_t arenaSize) {
-        s_outstandingPages++;
-
-        // TODO: mmap allocation code
-
-        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0) ;
-        if(*static_cast<int*>(ptr) == -1 || *static_cast<int*>(ptr) % 8 != 0)
+    static MMapObject* alloc(size_t size, size_t arenaSize, ArenaOwner* owner = nullptr, bool* zero = nullptr) {
+        bool fresh;
+        void *ptr = map(size, fresh);
+        if(ptr == nullptr)
             return nullptr;
         MMapObject* m_object = static_cast<MMapObject*>(ptr);
         m_object -> m_mmapSize = size;
         m_object -> m_arenaSize = arenaSize;
+        if(!PageMap::set(ptr, m_object->registeredPages(), PageMap::Entry{ m_object, owner, arenaSize })) {
+            unmap(ptr, size);
+            return nullptr;
+        }
+        s_outstandingPages++;
+        if(zero != nullptr) {
+            *zero = fresh;
+        }
+        return m_object;
+    }
+
+    /**
+     * Maps a BigAlloc of `size` bytes whose data starts one page in, at an
+     * address aligned to `alignment` (a power of two larger than a page). The
+     * mapping is trimmed down to just the object's own pages, and only the page
+     * its data starts in is registered.
+     */
+    static MMapObject* allocAligned(size_t size, size_t alignment) {
+        if(size > maxSize)
+            return nullptr;
+        char* start = mapTrimmed(size + guardFor(size) * pageSize, alignment, pageSize);
+        if(start == nullptr)
+            return nullptr;
+        protectGuard(start, size);
+        char* data = start + pageSize;
+
+        MMapObject* m_object = reinterpret_cast<MMapObject*>(start);
+        m_object -> m_mmapSize = size;
+        m_object -> m_arenaSize = 0;
+        if(!PageMap::set(data, 1, PageMap::Entry{ m_object, nullptr, 0 })) {
+            unmap(start, size);
+            return nullptr;
+        }
+        s_outstandingPages++;
         return m_object;
     }
 
     /**
-     * This function should deallocate the passed pointer by calling munmap.
+     * This function should deallocate the passed pointer by calling munmap (or by
+     * handing it back to the PageReserve if it came from there).
      * The passed pointer may not be at the start of the memory region, but will
      * be withing it, so you'll need to calculate the start of the MMapObject* ptr,
      * passing that as start of the region to unmap and ptr->mmapSize() as its length.
      * 
-     * Recall that Arenas will never be larger than the OS page size and BigAllocs
-     * always return a pointer to just after the MMapObject header, so you can
-     * jump back to the nearest multiple of page size and that will be the MMapObject*.
+     * The PageMap knows the start of the span for any pointer into an arena, and
+     * BigAllocs register the page of the pointer they hand out, so fromPointer()
+     * finds the MMapObject* for any pointer we hand out.
      */
     static void dealloc(void* obj) {
         size_t old = s_outstandingPages--;
@@ -83,14 +306,150 @@ public:
             raise(SIGTRAP);
         }
 
-        // TODO: munmap deallocation code
-        MMapObject *ptr = static_cast<MMapObject *>(obj);
-        int err = munmap(ptr, ptr->mmapSize());
-        if(err == -1) {
+        MMapObject *ptr = fromPointer(obj);
+        PageMap::clear(ptr->m_arenaSize != 0 ? ptr : obj, ptr->registeredPages());
+        if(!unmap(ptr, ptr->mmapSize())) {
             raise(SIGTRAP);
         }
     }
 
+    /**
+     * Resizes a BigAlloc to `size` bytes (header included) without copying: in
+     * place if its pages already fit, or by moving its pages with mremap if it
+     * was mapped directly and stays too big for the PageReserve. Returns the
+     * object's new address, or null if the caller has to copy instead.
+     */
+    static MMapObject* remap(MMapObject* obj, size_t size) {
+        if(size > maxSize) {
+            return nullptr;
+        }
+        size_t pages = pagesFor(obj->m_mmapSize);
+        size_t newPages = pagesFor(size);
+        if(newPages == pages) {
+            obj->m_mmapSize = size;
+            return obj;
+        }
+        // Hardened builds copy rather than move a mapping with its guard page.
+        if(PageReserve::contains(obj) || newPages <= maxMediumPages || guardPages != 0) {
+            return nullptr;
+        }
+        // Counted as an mmap call.
+        s_mmapCalls++;
+        void* ptr = mremap(obj, pages * pageSize, newPages * pageSize, MREMAP_MAYMOVE);
+        if(ptr == MAP_FAILED) {
+            return nullptr;
+        }
+        MMapObject* moved = static_cast<MMapObject*>(ptr);
+        if(moved != obj) {
+            // Register the new address before forgetting the old one. If that
+            // fails, move the pages back so the caller copies instead.
+            if(!PageMap::set(moved, 1, PageMap::Entry{ moved, nullptr, 0 })) {
+                s_mmapCalls++;
+                if(mremap(moved, newPages * pageSize, pages * pageSize, MREMAP_MAYMOVE | MREMAP_FIXED, obj) == MAP_FAILED) {
+                    raise(SIGTRAP);
+                }
+                return nullptr;
+            }
+            PageMap::clear(obj, 1);
+        }
+        moved->m_mmapSize = size;
+        return moved;
+    }
+
+    /**
+     * Maps `size` bytes with mmap such that `offset` bytes in is aligned to
+     * `alignment`, by mapping more than needed and unmapping the ends. Returns
+     * null on failure.
+     */
+    static char* mapTrimmed(size_t size, size_t alignment, size_t offset) {
+        size_t mapped = pagesFor(size) * pageSize;
+        size_t length;
+        if(size > maxSize || __builtin_add_overflow(mapped, alignment - pageSize, &length))
+            return nullptr;
+        s_mmapCalls++;
+        void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if(ptr == MAP_FAILED)
+            return nullptr;
+        char* raw = static_cast<char*>(ptr);
+        char* start = reinterpret_cast<char*>((((uintptr_t)raw + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - offset);
+        if(start != raw) {
+            s_munmapCalls++;
+            munmap(raw, start - raw);
+        }
+        if(raw + length != start + mapped) {
+            s_munmapCalls++;
+            munmap(start + mapped, raw + length - (start + mapped));
+        }
+        return start;
+    }
+
+    /**
+     * Maps `size` bytes for an object, from the PageReserve if it's small enough
+     * and with mmap otherwise. Returns null on failure. Sets `zero` to whether
+     * the pages are known to read as zero, which fresh mappings always do.
+     */
+    static void* map(size_t size, bool& zero) {
+        if(size > maxSize) {
+            return nullptr;
+        }
+        if(pagesFor(size) <= maxMediumPages) {
+            void* span = PageReserve::allocSpan(pagesFor(size), &zero);
+            if(span != nullptr) {
+                return span;
+            }
+        }
+        zero = true;
+        size_t mapped = (pagesFor(size) + guardFor(size)) * pageSize;
+        void* ptr;
+        if(MALLOC_HUGE_BIGALLOCS && size >= PageReserve::hugePageSize) {
+            ptr = mapTrimmed(mapped, PageReserve::hugePageSize, 0);
+            if(ptr == nullptr) {
+                return nullptr;
+            }
+            madvise(ptr, size, MADV_HUGEPAGE);
+        }
+        else {
+            s_mmapCalls++;
+            ptr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if(ptr == MAP_FAILED) {
+                return nullptr;
+            }
+        }
+        protectGuard(ptr, size);
+        return ptr;
+    }
+
+    /**
+     * Undoes map(). Returns false if munmap failed.
+     */
+    static bool unmap(void* ptr, size_t size) {
+        if(PageReserve::contains(ptr)) {
+            PageReserve::freeSpan(ptr, pagesFor(size));
+            return true;
+        }
+        s_munmapCalls++;
+        return munmap(ptr, (pagesFor(size) + guardFor(size)) * pageSize) == 0;
+    }
+
+    /**
+     * The number of guard pages after a direct mapping of `size` bytes.
+     */
+    static size_t guardFor(size_t size) {
+        return pagesFor(size) > maxMediumPages ? guardPages : 0;
+    }
+
+    /**
+     * Turns the guard page after a direct mapping of `size` bytes at `ptr`
+     * into a trap, if it gets one. Counted as an mmap call. If it fails (say
+     * we're out of mappings) we just go without.
+     */
+    static void protectGuard(void* ptr, size_t size) {
+        if(guardFor(size) != 0) {
+            s_mmapCalls++;
+            mprotect(static_cast<char*>(ptr) + pagesFor(size) * pageSize, guardFor(size) * pageSize, PROT_NONE);
+        }
+    }
+
     /**
      * Returns the number of pages outstanding that have not been collected.
      * Don't touch this.
@@ -98,18 +457,119 @@ public:
     static size_t outstandingPages() {
         return s_outstandingPages.load();
     }
+
+    /**
+     * The number of direct mmap calls made so far.
+     */
+    static size_t mmapCalls() {
+        return s_mmapCalls.load();
+    }
+
+    /**
+     * The number of direct munmap calls made so far.
+     */
+    static size_t munmapCalls() {
+        return s_munmapCalls.load();
+    }
 };
 
 class BigAlloc : public MMapObject {
     // This inherits from MMapObject, so it also has the mmapSize and arenSize
     // members as well.
 
-    char m_data[0];
+    // Whether the heap profiler sampled this BigAlloc, and if it stands in for
+    // an arena item, that item's class. Frees only look samples up in the
+    // profiler's table, so the rest never take its lock.
+    uint32_t m_sample;
+
+    alignas(16) char m_data[0];
+
+    static BigAlloc* of(void* data) {
+        return static_cast<BigAlloc*>(MMapObject::fromPointer(data));
+    }
+
+    /**
+     * Under MALLOC_HARDENED, the last word of a BigAlloc's pages holds a canary
+     * that's checked when it's freed, to catch writes past its usable size.
+     */
+    static uintptr_t* canaryOf(MMapObject* obj) {
+        return reinterpret_cast<uintptr_t*>(reinterpret_cast<char*>(obj) + pagesFor(obj->mmapSize()) * pageSize) - 1;
+    }
+
+    // What a store keeps where a cached BigAlloc's data was.
+    struct Cached {
+        BigAlloc* next;
+        uint64_t cachedAt;
+    };
+
+    Cached* cached() {
+        return reinterpret_cast<Cached*>(m_data);
+    }
+
+    static void* withCanary(MMapObject* obj, size_t offset) {
+        if(obj == nullptr)
+            return nullptr;
+        static_cast<BigAlloc*>(obj)->m_sample = unsampled;
+        if(canaryBytes != 0) {
+            uintptr_t* canary = canaryOf(obj);
+            *canary = heapSecret() ^ reinterpret_cast<uintptr_t>(canary);
+        }
+        return reinterpret_cast<char*>(obj) + offset;
+    }
 
 public:
+    // The bytes each BigAlloc sets aside for its canary.
+    static constexpr size_t canaryBytes = MallocPolicy::hardened ? sizeof(uintptr_t) : 0;
+
+    /**
+     * Sets `total` to the bytes a BigAlloc of `size` bytes whose data starts
+     * `offset` bytes in has to map, canary included. Returns false if that
+     * overflows, or is more than any object may map.
+     */
+    static bool totalFor(size_t size, size_t offset, size_t& total) {
+        return !__builtin_add_overflow(size, offset + canaryBytes, &total) && total <= maxSize;
+    }
+
+    // What sample() returns for a BigAlloc the heap profiler didn't sample,
+    // and for one it sampled that is just itself. Anything else is the class
+    // of the arena item it stands in for.
+    static constexpr uint32_t unsampled = UINT32_MAX;
+    static constexpr uint32_t sampledBig = UINT32_MAX - 1;
+
+    // What sample() returns for a BigAlloc that was freed and is cached by a
+    // store, so freeing it again is caught.
+    static constexpr uint32_t cachedSpan = UINT32_MAX - 2;
+
     BigAlloc(const BigAlloc& other) = delete;
     BigAlloc() = delete;
 
+    /**
+     * How the heap profiler sampled the BigAlloc whose data is at `data`.
+     */
+    static uint32_t sample(void* data) {
+        return of(data)->m_sample;
+    }
+
+    /**
+     * Marks the BigAlloc whose data is at `data` as sampled, either as itself
+     * (sampledBig) or standing in for an item of the given class.
+     */
+    static void setSample(void* data, uint32_t sample) {
+        of(data)->m_sample = sample;
+    }
+
+    /**
+     * Checks the canary of the BigAlloc whose data is at `data`, if there is one.
+     */
+    static void check(void* data) {
+        if(canaryBytes != 0) {
+            uintptr_t* canary = canaryOf(MMapObject::fromPointer(data));
+            if(*canary != (heapSecret() ^ reinterpret_cast<uintptr_t>(canary))) {
+                heapCorruption("write past the end of a BigAlloc", data);
+            }
+        }
+    }
+
     /**
      * This method should allocate a single large contiguous block of memory using
      * MMapObject::alloc(). You then need to treat that pointer as a BigAlloc*
@@ -118,11 +578,146 @@ public:
      * The returned address must be 64-bit aligned.
      */
     static void* alloc(size_t size) {
-        // TODO: allocate the BigAlloc.
-        BigAlloc* myBigAlloc = reinterpret_cast<BigAlloc *>(MMapObject::alloc(size, 0));
-        if(myBigAlloc == nullptr || sizeof(BigAlloc) % 8 != 0)
+        static_assert(sizeof(BigAlloc) % 8 == 0, "BigAlloc data must be 64-bit aligned");
+        return allocAt(size, sizeof(BigAlloc));
+    }
+
+    /**
+     * Like alloc(), but the data reads as zero. Only pages that may have been
+     * written before are cleared, so fresh ones aren't faulted in until used.
+     */
+    static void* allocZeroed(size_t size) {
+        size_t total;
+        if(!totalFor(size, sizeof(BigAlloc), total))
+            return nullptr;
+        bool zero;
+        void* data = withCanary(MMapObject::alloc(total, 0, nullptr, &zero), sizeof(BigAlloc));
+        if(data != nullptr && !zero) {
+            memset(data, 0, size);
+        }
+        return data;
+    }
+
+    /**
+     * Like alloc(), but the returned address is aligned to `alignment`, which
+     * must be a power of two. The data is padded out past the header to the
+     * alignment, or to the next page if it's a whole page or more.
+     */
+    static void* alloc(size_t size, size_t alignment) {
+        if(alignment >= pageSize) {
+            size_t total;
+            if(!totalFor(size, pageSize, total))
+                return nullptr;
+            return withCanary(MMapObject::allocAligned(total, alignment), pageSize);
+        }
+        return allocAt(size, dataOffset(alignment));
+    }
+
+    /**
+     * How far into its first page the data of a BigAlloc aligned to
+     * `alignment` (less than a page) starts.
+     */
+    static size_t dataOffset(size_t alignment) {
+        return alignment <= sizeof(BigAlloc) ? sizeof(BigAlloc) : alignment;
+    }
+
+    /**
+     * The pages of a medium BigAlloc of `size` bytes aligned to `alignment`,
+     * which a cached one of the same pages can be reused for, or zero if it
+     * isn't medium or is mapped to be page aligned.
+     */
+    static size_t spanPages(size_t size, size_t alignment) {
+        size_t total;
+        if(alignment >= pageSize || !totalFor(size, dataOffset(alignment), total)) {
+            return 0;
+        }
+        size_t pages = pagesFor(total);
+        return pages <= maxMediumPages ? pages : 0;
+    }
+
+    /**
+     * Likewise for the BigAlloc whose data is at `data`. Page aligned ones are
+     * registered at their data's page rather than their first, so aren't reused.
+     */
+    static size_t spanPages(void* data) {
+        MMapObject* obj = MMapObject::fromPointer(data);
+        if(static_cast<char*>(data) - reinterpret_cast<char*>(obj) >= static_cast<ptrdiff_t>(pageSize)) {
+            return 0;
+        }
+        size_t pages = pagesFor(obj->mmapSize());
+        return pages <= maxMediumPages ? pages : 0;
+    }
+
+    /**
+     * Marks the BigAlloc whose data is at `data`, which is being freed, as
+     * cached by a store in a list following `next`, and returns it. It keeps
+     * its pages and its PageMap entry until it's reused or deallocated.
+     */
+    static BigAlloc* cache(void* data, BigAlloc* next, uint64_t now) {
+        BigAlloc* span = of(data);
+        span->m_sample = cachedSpan;
+        span->cached()->next = next;
+        span->cached()->cachedAt = now;
+        return span;
+    }
+
+    BigAlloc*& nextCached() {
+        return cached()->next;
+    }
+
+    uint64_t cachedAt() {
+        return cached()->cachedAt;
+    }
+
+    /**
+     * Makes a BigAlloc of `size` bytes aligned to `alignment` out of a cached
+     * one with the pages it needs (see spanPages()), and returns its data.
+     * Whatever the old one held is still there.
+     */
+    static void* reuse(BigAlloc* span, size_t size, size_t alignment) {
+        size_t offset = dataOffset(alignment);
+        return withCanary(MMapObject::remap(span, size + offset + canaryBytes), offset);
+    }
+
+    /**
+     * Like alloc(), but the data starts `offset` bytes into the first page,
+     * where `offset` is a multiple of 8 at least sizeof(BigAlloc) and less than
+     * a page. Its data is aligned like whatever sits at that offset in a span.
+     */
+    static void* allocAt(size_t size, size_t offset) {
+        size_t total;
+        if(!totalFor(size, offset, total))
+            return nullptr;
+        return withCanary(MMapObject::alloc(total, 0), offset);
+    }
+
+    /**
+     * Resizes the BigAlloc whose data starts at `data` to hold `size` bytes
+     * without copying if possible (see MMapObject::remap()). Returns the new data
+     * pointer, or null if the caller has to allocate, copy and free instead.
+     * Aligned allocations are always copied.
+     */
+    static void* realloc(void* data, size_t size) {
+        MMapObject* obj = MMapObject::fromPointer(data);
+        if(data != &static_cast<BigAlloc *>(obj)->m_data[0])
+            return nullptr;
+        check(data);
+        size_t total;
+        if(!totalFor(size, sizeof(BigAlloc), total))
             return nullptr;
-        return (void *)&myBigAlloc->m_data[0];
+        MMapObject* moved = MMapObject::remap(obj, total);
+        if(moved == nullptr)
+            return nullptr;
+        return withCanary(moved, sizeof(BigAlloc));
+    }
+
+    /**
+     * The number of bytes the BigAlloc whose data starts at `data` can hold,
+     * which runs to the end of its last page (less the canary, if hardened).
+     */
+    static size_t size(void* data) {
+        MMapObject* obj = MMapObject::fromPointer(data);
+        return pagesFor(obj->mmapSize()) * pageSize - ((char *)data - (char *)obj) - canaryBytes;
     }
 };
 
@@ -132,13 +727,73 @@ class Arena : public MMapObject {
     // This inherits from MMapObject, so it also has the mmapSize and arenSize
     // members as well.
 
-    // You'll need some means of tracking the number of freed items in this arena
-    // in a thread-safe manner. That should go here.
-    // mything thing = stuff;
+    // The header is laid out by who writes it. The first cache line (with the
+    // MMapObject fields) is only written by the owner, the second holds what
+    // other threads write, the third is the owner's live slot bitmap, and the
+    // slots start on a line of their own.
+
+    // The store (and hence thread) that allocates out of this arena. Only the
+    // owner touches the fields on this line; other threads hand their frees
+    // back through remoteFree().
+    ArenaOwner* m_owner;
+
+    // The number of live items in this arena, including remote frees that
+    // haven't been collected yet.
     int item_count;
-    size_t size_remain;
+    // 2^32 / arenaSize(), rounded up, so slot numbers take a multiply and a
+    // shift instead of a division. Slot offsets are small enough for it to be
+    // exact.
+    uint32_t m_slotReciprocal;
+    // The number of bytes left to bump allocate. Arenas span a few pages.
+    uint32_t size_remain;
+    // Whether the owner has set remoteRetired.
+    bool m_retired;
+    // Whether the span read as zero when the arena was made, in which case
+    // slots past m_next still do, since nothing writes them until they're
+    // handed out.
+    bool m_zero;
     // A pointer to the next free address in the arena.
     char* m_next;
+    // Singly linked list of freed slots, threaded through the first word of
+    // each slot. alloc() recycles these before bumping m_next.
+    void* m_free;
+    // What free list links are xored with under MALLOC_HARDENED, so a stray
+    // write can't plant a pointer of its choosing. Only read through secret(),
+    // which is a constant zero otherwise.
+    uintptr_t m_secret;
+
+    // Lock-free stack of items freed by threads other than the owner, linked
+    // through the first word of each item. The owner takes the whole stack at
+    // once. The low bit is set while the arena is full and the owner isn't
+    // looking at it, in which case the first remote free must tell the owner.
+    alignas(cacheLineSize) std::atomic<uintptr_t> m_remoteFree;
+    // Link for the owner's stack of retired arenas that got remote frees.
+    Arena* m_nextDelayed;
+
+    static constexpr uintptr_t remoteRetired = 1;
+
+    // Links for the owner's list of partially free arenas. These are only
+    // touched when the arena moves between lists, so they can share the line.
+    Arena* m_prevArena;
+    Arena* m_nextArena;
+    // When the owner put this arena in its empty arena cache.
+    uint64_t m_emptiedAt;
+    // Links for the owner's list of every arena it has, for walking them.
+    Arena* m_prevOwned;
+    Arena* m_nextOwned;
+
+public:
+    static constexpr bool slotBitmap = MALLOC_SLOT_BITMAP;
+    static constexpr bool hardened = MallocPolicy::hardened;
+
+    // The most slots an arena has, one bit each in its bitmap.
+    static constexpr size_t maxSlots = slotBitmap ? 512 : SIZE_MAX;
+
+private:
+    // A bit per slot, set while the slot is allocated (remote frees not yet
+    // collected included), so live items can be found and checked without
+    // walking any free list. Empty without MALLOC_SLOT_BITMAP.
+    alignas(cacheLineSize) uint64_t m_live[slotBitmap ? maxSlots / 64 : 0];
 
     // This might look kind of weird as it's size is zero, but this serves as a surrogate
     // location to start of the arena's allocation slots. That is &this->m_data[0] is a pointer
@@ -150,140 +805,1760 @@ class Arena : public MMapObject {
     // padding or to ensure the sizes of your previous members ensures this happens before this.
     //
     // If sizeof(Arena) % 8 == 0, you should be good.
-    char m_data[0];
+    alignas(cacheLineSize) char m_data[0];
 
 public:
     /**
-     * Creates an arena with items of the given size. You should allocate with
-     * MMapObject::alloc() and coerce the result into an Arena*.
+     * Creates an arena of `pages` pages with items of the given size owned by the
+     * given store. You should allocate with MMapObject::alloc() and coerce the
+     * result into an Arena*.
      */
-    static Arena* create(uint32_t itemSize) {
-        // TODO: create and initialize the arena.
-        Arena* myArena = reinterpret_cast<Arena *>(MMapObject::alloc(pageSize, itemSize));
+    static Arena* create(uint32_t itemSize, ArenaOwner* owner = nullptr, size_t pages = 1) {
+        bool zero;
+        Arena* myArena = reinterpret_cast<Arena *>(MMapObject::alloc(pages * pageSize, itemSize, owner, &zero));
         if(myArena == nullptr || sizeof(Arena) % 8 != 0)
             return nullptr;
+        myArena->m_owner = owner;
         myArena->m_next = &myArena->m_data[0];
+        myArena->m_free = nullptr;
+        myArena->m_prevArena = nullptr;
+        myArena->m_nextArena = nullptr;
+        myArena->m_prevOwned = nullptr;
+        myArena->m_nextOwned = nullptr;
+        myArena->m_remoteFree.store(0, std::memory_order_relaxed);
+        myArena->m_nextDelayed = nullptr;
+        myArena->m_retired = false;
+        myArena->m_zero = zero;
+        myArena->m_emptiedAt = 0;
         myArena->item_count = 0;
-        myArena->size_remain = pageSize;
+        if(hardened) {
+            myArena->m_secret = mixBits(heapSecret() ^ reinterpret_cast<uintptr_t>(myArena));
+        }
+        myArena->m_slotReciprocal = static_cast<uint32_t>(((uint64_t(1) << 32) + itemSize - 1) / itemSize);
+        if(!zero) {
+            for(uint64_t& word : myArena->m_live) {
+                word = 0;
+            }
+        }
+        // Slots past what the bitmap covers are left unused.
+        size_t slots = (pages * pageSize - sizeof(Arena)) / itemSize;
+        myArena->size_remain = static_cast<uint32_t>((slots < maxSlots ? slots : maxSlots) * itemSize);
         return myArena;
     }
 
     /**
-     * Allocates an item in the arena and returns its address. Returns null if you
-     * have already exceeded the bounds of the arena.
+     * Allocates an item in the arena and returns its address. Previously freed
+     * slots are handed out first, and once the local slots run out anything other
+     * threads have freed is collected. Returns null if there are no free slots left.
      */
     void* alloc() {
-        // TODO: return a pointer to an item in this arena. We should return nullptr
-        // if there are no more slots in which to allocate data.
-        if(this->full())
+        if(this->full()) {
+            collectRemote();
+        }
+        if(this->m_free != nullptr) {
+            void* result = this->m_free;
+            this->m_free = nextOf(result);
+            this->item_count++;
+            markLive(slotOf(result));
+            return result;
+        }
+        if(this->arenaSize() > this->size_remain)
             return nullptr;
         this->size_remain -= this->arenaSize();
         this->item_count++;
-        char* result = this->m_next + this->arenaSize();
-        this->m_next = result;
-        return (void *)this->m_next; 
+        char* result = this->m_next;
+        this->m_next = result + this->arenaSize();
+        markLive(slotOf(result));
+        return (void *)result;
     }
 
     /**
-     * Marks one of the items in the arena as freed. Returns true if this arena
-     * has no more allocation slots and everything is free'd.
+     * Like alloc(), but the item reads as zero. Slots bumped off a span that
+     * was zero to begin with are left alone, so calloc() doesn't fault in pages
+     * before the caller uses them.
      */
-    bool free() {
-        // TODO: actually free an item the arena.
-        if(this->item_count > 0) {
-            this->item_count--;
+    void* allocZeroed() {
+        if(this->full()) {
+            collectRemote();
         }
-        if(this->item_count == 0 && this->full()) {
-            return true;
+        bool fresh = this->m_zero && this->m_free == nullptr;
+        void* result = alloc();
+        if(result != nullptr && !fresh) {
+            memset(result, 0, this->arenaSize());
+        }
+        return result;
+    }
+
+    /**
+     * Allocates up to `count` items into `out` and returns how many it got. Free
+     * slots are taken first, then the rest are carved off the bump region as a
+     * single contiguous run. A batch that takes every free slot finds them in
+     * the bitmap, up to 64 at a time, rather than by chasing the free list
+     * through each of them.
+     */
+    size_t allocBatch(void** out, size_t count) {
+        if(this->full()) {
+            collectRemote();
+        }
+        size_t result = 0;
+        size_t bumped = slotOf(this->m_next);
+        // Every slot below the bump pointer that isn't live is on the free list.
+        size_t listed = bumped - this->item_count;
+        if(slotBitmap && listed > 0 && count >= listed) {
+            for(size_t word = 0; word * 64 < bumped; word++) {
+                uint64_t mask = bumped - word * 64 >= 64 ? ~uint64_t(0) : (uint64_t(1) << (bumped - word * 64)) - 1;
+                uint64_t free = ~m_live[word] & mask;
+                m_live[word] |= free;
+                while(free != 0) {
+                    out[result++] = slot(word * 64 + __builtin_ctzll(free));
+                    free &= free - 1;
+                }
+            }
+            this->m_free = nullptr;
         }
         else {
-            return false;
+            while(result < count && this->m_free != nullptr) {
+                out[result] = this->m_free;
+                this->m_free = nextOf(this->m_free);
+                markLive(slotOf(out[result++]));
+            }
+        }
+        size_t run = this->size_remain / this->arenaSize();
+        if(run > count - result) {
+            run = count - result;
         }
+        for(size_t i = 0; i < run; i++) {
+            out[result++] = this->m_next + i * this->arenaSize();
+            markLive(bumped + i);
+        }
+        this->m_next += run * this->arenaSize();
+        this->size_remain -= run * this->arenaSize();
+        this->item_count += result;
+        return result;
     }
 
     /**
-     * Whether or not this arena can hold more items.
+     * Returns the given item to the arena's free list so a later alloc() can
+     * reuse it. Returns true if everything in the arena is now free'd.
      */
-    bool full() {
-        // TODO: acutally compute full()
-        if(this->arenaSize() > this->size_remain)
-            return true;
-        else
-            return false;
+    bool free(void* ptr) {
+        return free(ptr, ptr, 1);
     }
 
     /**
-     * Returns a pointer to the next free item in the arena.
+     * Returns `count` items, already linked from `first` to `last` with
+     * setNext(), to the free list at once. Returns true if everything in the
+     * arena is now free'd.
      */
-    char* next() {
-        return m_next;
+    bool free(void* first, void* last, int count) {
+        void* item = first;
+        for(int i = 1; i < count; i++) {
+            checkFree(item);
+            item = nextOf(item);
+        }
+        checkFree(last);
+        setNext(last, this->m_free);
+        this->m_free = first;
+        this->item_count -= count;
+        return this->item_count == 0;
     }
-};
 
-class ArenaStore {
     /**
-     * A set of arenas with the following sizes:
-     * 0: 8 bytes
-     * 1: 16 bytes
-     * 2: 32 bytes
-     * ...
-     * 8: 1024 bytes
+     * Frees an item from a thread other than the owner with a single compare and
+     * swap. Returns true if the arena was retired, in which case the caller must
+     * hand it to the owner with ArenaOwner::delay(); only one caller ever will.
      */
-    Arena* m_arenas[9]; // Default initializer for pointer is nullptr
+    bool remoteFree(void* ptr) {
+        return remoteFree(ptr, ptr);
+    }
 
-public:
     /**
-     * Allocates `bytes` bytes of data. If the data is too large to fit in an arena,
-     * it will be allocated using BigAlloc.
+     * Like remoteFree(), but pushes a chain of items linked from `first` to
+     * `last` with the same single compare and swap.
      */
-    void* alloc(size_t bytes) {
-        // TODO: implement alloc
-        if(bytes > 1024) {
-            return BigAlloc::alloc(bytes);
-        }
-        int arena_index;
-        if(bytes <= 8) {
-            bytes = 8;
-            arena_index = 0;
-        }
-        else {
-            size_t i = 1;
-            arena_index = 0;
-            size_t tmp = bytes;
-            while(bytes >>= 1) {
-                i <<= 1;
-                arena_index++;
+    bool remoteFree(void* first, void* last) {
+        uintptr_t head = m_remoteFree.load(std::memory_order_relaxed);
+        do {
+            setNext(last, reinterpret_cast<void*>(head & ~remoteRetired));
+        } while(!m_remoteFree.compare_exchange_weak(head, reinterpret_cast<uintptr_t>(first), std::memory_order_release, std::memory_order_relaxed));
+        return (head & remoteRetired) != 0;
+    }
+
+    /**
+     * Moves every item other threads have freed onto the local free list in one
+     * batch. Only the owner may call this, and not while the arena is retired.
+     * Returns true if everything in the arena is now free'd.
+     */
+    bool collectRemote() {
+        if(m_remoteFree.load(std::memory_order_relaxed) == 0) {
+            return this->item_count == 0;
+        }
+        void* list = reinterpret_cast<void*>(m_remoteFree.exchange(0, std::memory_order_acquire));
+        void* tail = list;
+        int count = 1;
+        checkFree(tail);
+        for(void* next = nextOf(tail); next != nullptr; next = nextOf(tail)) {
+            tail = next;
+            checkFree(tail);
+            count++;
+        }
+        setNext(tail, this->m_free);
+        this->m_free = list;
+        this->item_count -= count;
+        return this->item_count == 0;
+    }
+
+    /**
+     * Called by the owner when it stops allocating from this full arena. Remote
+     * frees will then notify the owner. Returns false if remote frees are
+     * already pending, in which case the arena isn't really full.
+     */
+    bool retire() {
+        uintptr_t expected = 0;
+        m_retired = m_remoteFree.compare_exchange_strong(expected, remoteRetired, std::memory_order_acq_rel);
+        return m_retired;
+    }
+
+    /**
+     * Called by the owner before handing out items again. Returns true if
+     * the arena was still retired, or false if it has been or will be passed
+     * to ArenaOwner::delay() by a remote free (or was never retired).
+     */
+    bool reclaim() {
+        if(!m_retired) {
+            return false;
+        }
+        m_retired = false;
+        return (m_remoteFree.fetch_and(~remoteRetired, std::memory_order_acquire) & remoteRetired) != 0;
+    }
+
+    /**
+     * Pushes this arena onto a store's delayed stack.
+     */
+    void pushDelayed(std::atomic<Arena*>& head) {
+        Arena* next = head.load(std::memory_order_relaxed);
+        do {
+            m_nextDelayed = next;
+        } while(!head.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /**
+     * The next arena on a store's delayed stack.
+     */
+    Arena* nextDelayed() {
+        return m_nextDelayed;
+    }
+
+    /**
+     * When this arena was put in its owner's empty arena cache.
+     */
+    uint64_t emptiedAt() {
+        return m_emptiedAt;
+    }
+
+    void setEmptiedAt(uint64_t when) {
+        m_emptiedAt = when;
+    }
+
+    /**
+     * The next arena in the list this arena is linked into.
+     */
+    Arena* nextArena() {
+        return m_nextArena;
+    }
+
+    /**
+     * The first slot in the arena, for callers that carve it up themselves.
+     */
+    char* data() {
+        return &m_data[0];
+    }
+
+    /**
+     * The number of the slot `ptr` points into.
+     */
+    size_t slotOf(const void* ptr) {
+        uint64_t offset = static_cast<const char*>(ptr) - &m_data[0];
+        return (offset * m_slotReciprocal) >> 32;
+    }
+
+    /**
+     * The address of the given slot.
+     */
+    void* slot(size_t index) {
+        return &m_data[index * arenaSize()];
+    }
+
+    /**
+     * Whether the given slot is allocated, or was freed by another thread and
+     * the owner hasn't collected it yet. Needs MALLOC_SLOT_BITMAP.
+     */
+    bool live(size_t index) {
+        return (m_live[index / 64] >> (index % 64) & 1) != 0;
+    }
+
+    /**
+     * The number of live slots, counted from the bitmap. This matches the item
+     * count unless the bookkeeping was corrupted (or there's no bitmap).
+     */
+    size_t liveCount() {
+        size_t result = 0;
+        for(uint64_t word : m_live) {
+            result += __builtin_popcountll(word);
+        }
+        return result;
+    }
+
+    /**
+     * Calls `visit` with every live item, a bitmap word at a time. Only the
+     * owner may call this.
+     */
+    template<typename Visit>
+    void forEachLive(Visit visit) {
+        for(size_t word = 0; word < sizeof(m_live) / sizeof(m_live[0]); word++) {
+            uint64_t bits = m_live[word];
+            while(bits != 0) {
+                visit(slot(word * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    /**
+     * Links this arena into the front of an owner's list of all its arenas.
+     */
+    void linkOwned(Arena*& head) {
+        m_prevOwned = nullptr;
+        m_nextOwned = head;
+        if(head != nullptr) {
+            head->m_prevOwned = this;
+        }
+        head = this;
+    }
+
+    /**
+     * Unlinks this arena from the list of all its owner's arenas.
+     */
+    void unlinkOwned(Arena*& head) {
+        if(m_prevOwned != nullptr) {
+            m_prevOwned->m_nextOwned = m_nextOwned;
+        }
+        else {
+            head = m_nextOwned;
+        }
+        if(m_nextOwned != nullptr) {
+            m_nextOwned->m_prevOwned = m_prevOwned;
+        }
+    }
+
+    Arena* nextOwned() {
+        return m_nextOwned;
+    }
+
+    /**
+     * Whether ptr points into this arena's span.
+     */
+    bool contains(void* ptr) {
+        return static_cast<size_t>(static_cast<char*>(ptr) - reinterpret_cast<char*>(this)) < mmapSize();
+    }
+
+    /**
+     * Whether ptr is the start of one of this arena's slots.
+     */
+    bool isSlot(void* ptr) {
+        return contains(ptr) && ptr >= &m_data[0] && slotOf(ptr) < maxSlots && slot(slotOf(ptr)) == ptr;
+    }
+
+    /**
+     * What free list links are xored with: this arena's secret when hardened,
+     * and nothing at all otherwise.
+     */
+    uintptr_t secret() const {
+        return hardened ? m_secret : 0;
+    }
+
+    /**
+     * Links a free item to the next one on whichever list it's on: the free
+     * list, the remote stack or a chain of items being freed together.
+     */
+    void setNext(void* item, void* next) {
+        *static_cast<uintptr_t*>(item) = reinterpret_cast<uintptr_t>(next) ^ secret();
+    }
+
+    /**
+     * The item after `item` on its list. Under MALLOC_HARDENED, a link that
+     * doesn't decode to one of our slots means something wrote over it.
+     */
+    void* nextOf(void* item) {
+        void* next = reinterpret_cast<void*>(*static_cast<uintptr_t*>(item) ^ secret());
+        if(hardened && next != nullptr && !isSlot(next)) {
+            heapCorruption("corrupted free list", item);
+        }
+        return next;
+    }
+
+private:
+    void markLive(size_t index) {
+        if(slotBitmap) {
+            if(hardened && live(index)) {
+                heapCorruption("corrupted free list", slot(index));
+            }
+            m_live[index / 64] |= uint64_t(1) << (index % 64);
+        }
+    }
+
+    void markFree(size_t index) {
+        if(slotBitmap) {
+            m_live[index / 64] &= ~(uint64_t(1) << (index % 64));
+        }
+    }
+
+    /**
+     * Marks an item being freed, checking under MALLOC_HARDENED that it's a
+     * slot and that it's live.
+     */
+    void checkFree(void* item) {
+        if(hardened) {
+            if(!isSlot(item)) {
+                heapCorruption("free of a pointer that isn't an item", item);
+            }
+            if(!live(slotOf(item))) {
+                heapCorruption("double free", item);
+            }
+        }
+        markFree(slotOf(item));
+    }
+
+public:
+    /**
+     * Whether or not this arena can hold more items.
+     */
+    bool full() {
+        if(this->m_free == nullptr && this->arenaSize() > this->size_remain)
+            return true;
+        else
+            return false;
+    }
+
+    /**
+     * Returns a pointer to the next free item in the arena.
+     */
+    char* next() {
+        return m_next;
+    }
+
+    /**
+     * The store that allocates from this arena, or null for a standalone arena.
+     */
+    ArenaOwner* owner() {
+        return m_owner;
+    }
+
+    /**
+     * Pushes this arena onto the front of the list whose head is `head`.
+     */
+    void link(Arena*& head) {
+        m_prevArena = nullptr;
+        m_nextArena = head;
+        if(head != nullptr) {
+            head->m_prevArena = this;
+        }
+        head = this;
+    }
+
+    /**
+     * Removes this arena from the list whose head is `head`.
+     */
+    void unlink(Arena*& head) {
+        if(m_prevArena != nullptr) {
+            m_prevArena->m_nextArena = m_nextArena;
+        }
+        else {
+            head = m_nextArena;
+        }
+        if(m_nextArena != nullptr) {
+            m_nextArena->m_prevArena = m_prevArena;
+        }
+        m_prevArena = nullptr;
+        m_nextArena = nullptr;
+    }
+};
+
+inline void ArenaOwner::delay(Arena* arena) {
+    arena->pushDelayed(m_delayed);
+}
+
+/**
+ * Maps request sizes onto arena item sizes, for the sizes and span limits of
+ * the given policy. The lookup is a single load from a table built at compile
+ * time, so it costs the same for every small size.
+ */
+template<typename Policy>
+class SizeClassTable {
+public:
+    // The item size of each class, smallest first.
+    static constexpr const size_t* sizes = Policy::sizes;
+
+    // The number of arena size classes.
+    static constexpr size_t count = sizeof(Policy::sizes) / sizeof(Policy::sizes[0]);
+
+    // The largest request served from an arena. Anything bigger is a BigAlloc.
+    static constexpr size_t maxSize = sizes[count - 1];
+
+    /**
+     * The class for a request of `bytes` bytes, which must be at most maxSize.
+     */
+    static size_t index(size_t bytes) {
+        return s_index.entries[(bytes + 7) >> 3];
+    }
+
+    /**
+     * The first class for a request of `bytes` bytes (at most maxSize) whose
+     * slots are all aligned to `alignment`, a power of two, or `count` if none
+     * of them are. Slots are aligned when both the arena header and their size
+     * are, since spans start on a page. malloc()'s alignment is a table lookup
+     * like index().
+     */
+    static size_t alignedIndex(size_t bytes, size_t alignment) {
+        if(alignment <= 8) {
+            return index(bytes);
+        }
+        if(alignment == alignof(max_align_t)) {
+            return s_maxAlignedIndex.entries[(bytes + 7) >> 3];
+        }
+        if(sizeof(Arena) % alignment != 0) {
+            return count;
+        }
+        size_t sizeClass = index(bytes);
+        while(sizeClass < count && size(sizeClass) % alignment != 0) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    /**
+     * The item size of the given class.
+     */
+    static constexpr size_t size(size_t sizeClass) {
+        return sizes[sizeClass];
+    }
+
+    /**
+     * How many items of the given class fit in an arena of `pages` pages.
+     */
+    static constexpr size_t slotsIn(size_t sizeClass, size_t pages) {
+        return (pages * pageSize - sizeof(Arena)) / size(sizeClass) < Arena::maxSlots
+            ? (pages * pageSize - sizeof(Arena)) / size(sizeClass) : Arena::maxSlots;
+    }
+
+    /**
+     * How many items of the given class fit in a single page arena.
+     */
+    static constexpr size_t slotsPerPage(size_t sizeClass) {
+        return slotsIn(sizeClass, 1);
+    }
+
+    /**
+     * How many pages an arena of the given class spans.
+     */
+    static size_t spanPages(size_t sizeClass) {
+        return s_spanPages.entries[sizeClass];
+    }
+
+    /**
+     * How many items of the given class fit in one of its arenas.
+     */
+    static size_t slotsPerSpan(size_t sizeClass) {
+        return slotsIn(sizeClass, spanPages(sizeClass));
+    }
+
+private:
+    // Every size class is a multiple of 8, so requests are looked up by their
+    // size in 8 byte units, rounded up. Each entry is the first class big
+    // enough whose slots are aligned to `alignment`, or `count` if none are.
+    template<size_t alignment>
+    struct IndexTable {
+        uint8_t entries[maxSize / 8 + 1];
+
+        constexpr IndexTable() : entries() {
+            size_t sizeClass = 0;
+            for(size_t i = 0; i <= maxSize / 8; i++) {
+                while(sizeClass < count && (sizes[sizeClass] < i * 8 || sizes[sizeClass] % alignment != 0
+                        || sizeof(Arena) % alignment != 0)) {
+                    sizeClass++;
+                }
+                entries[i] = static_cast<uint8_t>(sizeClass);
+            }
+        }
+    };
+
+    static const IndexTable<8> s_index;
+    static const IndexTable<alignof(max_align_t)> s_maxAlignedIndex;
+
+    // Bytes of a span of `pages` pages lost to the header and the tail that is
+    // too small for another item (or past what the slot bitmap covers).
+    static constexpr size_t spanWaste(size_t sizeClass, size_t pages) {
+        return pages * pageSize - slotsIn(sizeClass, pages) * sizes[sizeClass];
+    }
+
+    // The fewest pages that keep spanWaste within the policy's
+    // maxSpanWastePercent, or the least wasteful span if none do.
+    struct SpanTable {
+        uint8_t entries[count];
+
+        constexpr SpanTable() : entries() {
+            for(size_t i = 0; i < count; i++) {
+                size_t best = 1;
+                for(size_t pages = 1; pages <= Policy::maxSpanPages; pages++) {
+                    if(spanWaste(i, pages) * 100 <= Policy::maxSpanWastePercent * pages * pageSize) {
+                        best = pages;
+                        break;
+                    }
+                    if(spanWaste(i, pages) * best < spanWaste(i, best) * pages) {
+                        best = pages;
+                    }
+                }
+                entries[i] = static_cast<uint8_t>(best);
+            }
+        }
+    };
+
+    static const SpanTable s_spanPages;
+
+public:
+    /**
+     * Whether the configured sizes are ascending multiples of 8.
+     */
+    static constexpr bool valid() {
+        for(size_t i = 0; i < count; i++) {
+            if(sizes[i] % 8 != 0 || (i > 0 && sizes[i] <= sizes[i - 1])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(sizes[0] >= sizeof(void*), "Freed items must be able to hold a free list link");
+    static_assert(count <= UINT8_MAX, "Size classes are indexed with a uint8_t");
+    static_assert(Policy::maxSpanPages >= 1 && Policy::maxSpanPages <= maxSpanPages, "Arenas span one to maxSpanPages pages");
+    static_assert(maxSize <= Policy::maxSpanPages * pageSize - sizeof(Arena), "Every size class must fit in an arena");
+};
+
+template<typename Policy>
+inline constexpr typename SizeClassTable<Policy>::template IndexTable<8> SizeClassTable<Policy>::s_index
+    = IndexTable<8>();
+template<typename Policy>
+inline constexpr typename SizeClassTable<Policy>::template IndexTable<alignof(max_align_t)>
+    SizeClassTable<Policy>::s_maxAlignedIndex = IndexTable<alignof(max_align_t)>();
+template<typename Policy>
+inline constexpr typename SizeClassTable<Policy>::SpanTable SizeClassTable<Policy>::s_spanPages = SpanTable();
+
+// The size classes of the build's policy.
+using SizeClass = SizeClassTable<MallocPolicy>;
+
+static_assert(sizeof(Arena) % cacheLineSize == 0, "Arena slots must start on a cache line");
+static_assert(sizeof(Arena) == (Arena::slotBitmap ? 3 : 2) * cacheLineSize,
+    "The owner's fields must fit on the arena header's first cache line");
+
+/**
+ * A per-thread set of arenas. Each thread allocates from its own store, so the
+ * malloc path never touches memory another thread is writing to. Frees of items
+ * owned by another thread's store go onto the item's arena with Arena::remoteFree()
+ * and are picked up by the owner the next time it allocates from that arena.
+ * Retired (full) arenas that get remote frees are put on the store's delayed
+ * stack so the owner can find them again.
+ *
+ * Remote frees are handed back in batches: each store chains its frees into
+ * another store's arena, per size class, and pushes the chain with one compare
+ * and swap once it holds MALLOC_TRANSFER_BATCH items or the next free is into
+ * a different arena. The owner takes every batch pushed onto an arena with one
+ * exchange when it runs out, so a thread that only frees and one that only
+ * allocates meet once per batch rather than once per item. A store holds at
+ * most one unfinished batch per class, until it collects or its thread exits.
+ *
+ * When a thread exits its store is collected, releasing whatever is empty, and
+ * left for the next new thread to adopt along with the arenas still in use.
+ *
+ * Its size classes, cache depths, checks and counters come from the Policy (see
+ * DefaultPolicy), so whatever a policy turns off costs nothing at run time.
+ * Every thread's store is an ArenaStore, for the build's MALLOC_POLICY.
+ */
+template<typename Policy>
+class BasicArenaStore : public ArenaOwner {
+public:
+    using SizeClass = SizeClassTable<Policy>;
+
+    static_assert(SizeClass::valid(), "Size classes must be ascending multiples of 8");
+    static_assert(Policy::hardened == Arena::hardened, "Arenas are hardened or not for the whole build");
+
+private:
+    /**
+     * The arena currently allocated from for each SizeClass.
+     */
+    Arena* m_arenas[SizeClass::count]; // Default initializer for pointer is nullptr
+
+    // For each size class, the arenas other than m_arenas[i] that have free slots.
+    // Full arenas are in neither and are found again through their frees.
+    Arena* m_partial[SizeClass::count];
+
+    // For each size class, arenas with nothing allocated, newest first. These
+    // are reused before mapping new arenas and released once they decay.
+    Arena* m_empty[SizeClass::count];
+    uint8_t m_emptyCount[SizeClass::count];
+
+    // How many more empty arenas than one each class may cache. It grows when
+    // the class creates an arena after turning one away for lack of room, and
+    // shrinks as cached ones decay unused.
+    uint8_t m_emptyGrowth[SizeClass::count];
+    bool m_emptyOverflowed[SizeClass::count];
+
+    // Freed medium BigAllocs kept whole for reuse, by page count, newest
+    // first, and how many pages they hold in all (see cacheSpan()).
+    BigAlloc* m_spans[maxMediumPages + 1];
+    size_t m_spanPages;
+
+    // When to next look for decayed empty arenas and spans.
+    uint64_t m_nextPurge;
+
+    // Every arena this store has, in whatever state, for walking them.
+    // Guarded by m_cacheLock, since cached ones may be released by others.
+    Arena* m_owned;
+
+    // Guards the empty arena and span caches and m_nextPurge, since the
+    // background purger and myMallocTrim() release cached ones from other
+    // threads. Arenas are only released with it held, which keeps
+    // arenasReleased single writer.
+    std::mutex m_cacheLock;
+
+    /**
+     * Frees of another store's items waiting to be handed back: a chain of
+     * `count` items linked from `first` to `last`, all from `arena`, started
+     * when m_remoteFrees was `startedAt`.
+     */
+    struct Transfer {
+        Arena* arena;
+        void* first;
+        void* last;
+        size_t count;
+        uint64_t startedAt;
+    };
+
+    // The unfinished batch for each size class.
+    Transfer m_transfers[SizeClass::count];
+
+    // How many of other stores' items we've freed, which is the clock batches
+    // are aged by, and when to next look for stale ones.
+    uint64_t m_remoteFrees;
+    uint64_t m_nextTransferSweep;
+
+    // Bytes left to allocate before the next heap profile sample, and the
+    // random state its countdowns are drawn from (zero until the first draw).
+    int64_t m_untilSample;
+    uint64_t m_sampleState;
+
+public:
+    /**
+     * What a store counts about one size class. Other stores' frees into our
+     * arenas are counted by them, as remoteFrees.
+     */
+    struct ClassStats {
+        StatCounter allocs;
+        StatCounter frees;
+        StatCounter remoteFrees;
+        StatCounter bytesRequested;
+        StatCounter arenasCreated;
+        StatCounter arenasReleased;
+    };
+
+    /**
+     * A store's share of the allocator statistics. See myMallocStats().
+     */
+    struct Stats {
+        ClassStats classes[SizeClass::count];
+        StatCounter bigAllocs;
+        StatCounter bigFrees;
+        StatCounter bigBytesAllocated;
+        StatCounter bigBytesFreed;
+    };
+
+private:
+    Stats m_stats;
+
+    // The next store in the list of all of them, for gathering statistics.
+    BasicArenaStore* m_nextStore;
+
+    // The next store left by an exited thread, while this one is too.
+    BasicArenaStore* m_nextAbandoned;
+
+    /**
+     * Bumps one of the per-call counters, unless the policy leaves them out.
+     */
+    static void tally(StatCounter& counter, uint64_t n) {
+        if(Policy::stats) {
+            counter.add(n);
+        }
+    }
+
+    /**
+     * Unmaps one of our arenas. Call with m_cacheLock held.
+     */
+    void releaseArena(Arena* arena, size_t arena_index) {
+        arena->unlinkOwned(m_owned);
+        m_stats.classes[arena_index].arenasReleased.add(1);
+        MMapObject::dealloc((void *)arena);
+    }
+
+    /**
+     * Called when one of our arenas, other than a current one, has nothing left
+     * allocated in it. It's cached for reuse if there's room, otherwise released.
+     */
+    void releaseEmpty(Arena* arena, size_t arena_index) {
+        flushTransfers();
+        std::lock_guard<std::mutex> guard(m_cacheLock);
+        if(m_emptyCount[arena_index] >= emptyLimit(arena_index)) {
+            m_emptyOverflowed[arena_index] = true;
+            releaseArena(arena, arena_index);
+            return;
+        }
+        uint64_t now = monotonicMillis();
+        arena->setEmptiedAt(now);
+        arena->link(m_empty[arena_index]);
+        m_emptyCount[arena_index]++;
+        purgeLocked(now, false);
+    }
+
+    /**
+     * Releases cached empty arenas and spans that have sat unused for
+     * MALLOC_DECAY_MS, or all of them. Unless it's all, this walks the caches at
+     * most twice per decay interval. Call with m_cacheLock held.
+     */
+    void purgeLocked(uint64_t now, bool all) {
+        if(!all && now < m_nextPurge) {
+            return;
+        }
+        m_nextPurge = now + decayMillis / 2;
+        for(size_t i = 0; i < SizeClass::count; i++) {
+            Arena* arena = m_empty[i];
+            while(arena != nullptr) {
+                Arena* next = arena->nextArena();
+                if(all || now - arena->emptiedAt() >= decayMillis) {
+                    arena->unlink(m_empty[i]);
+                    m_emptyCount[i]--;
+                    releaseArena(arena, i);
+                    if(!all && m_emptyGrowth[i] > 0) {
+                        m_emptyGrowth[i]--;
+                    }
+                }
+                arena = next;
+            }
+        }
+        for(size_t pages = 1; pages <= maxMediumPages; pages++) {
+            // Spans are cached newest first, so the decayed ones are the tail.
+            BigAlloc** link = &m_spans[pages];
+            while(*link != nullptr && !all && now - (*link)->cachedAt() < decayMillis) {
+                link = &(*link)->nextCached();
+            }
+            BigAlloc* span = *link;
+            *link = nullptr;
+            while(span != nullptr) {
+                BigAlloc* next = span->nextCached();
+                m_spanPages -= pages;
+                MMapObject::dealloc(span);
+                span = next;
+            }
+        }
+    }
+
+    /**
+     * Frees `count` items linked from `first` to `last` that live in one of our
+     * own arenas.
+     */
+    void freeLocal(Arena* arena, void* first, void* last, int count) {
+        size_t arena_index = SizeClass::index(arena->arenaSize());
+        bool empty = arena->free(first, last, count);
+        tally(m_stats.classes[arena_index].frees, count);
+
+        if(arena == m_arenas[arena_index]) {
+            return;
+        }
+        if(arena->reclaim()) {
+            // Nobody else knows about this arena, so it's ours to list or release.
+            if(empty) {
+                releaseEmpty(arena, arena_index);
+            }
+            else {
+                arena->link(m_partial[arena_index]);
+            }
+        }
+        else if(empty) {
+            // A delayed arena always has uncollected remote frees, so it can't
+            // be empty here. This one must be partial.
+            arena->unlink(m_partial[arena_index]);
+            releaseEmpty(arena, arena_index);
+        }
+    }
+
+    /**
+     * Adds `count` items of another store's arena, linked from `first` to
+     * `last`, to the batch being handed back for their class.
+     */
+    void transfer(Arena* arena, size_t arena_index, void* first, void* last, size_t count) {
+        tally(m_stats.classes[arena_index].remoteFrees, count);
+        m_remoteFrees += count;
+        Transfer& batch = m_transfers[arena_index];
+        if(batch.arena != arena) {
+            flushTransfer(batch);
+            batch.arena = arena;
+            batch.first = first;
+            batch.last = last;
+            batch.count = count;
+            batch.startedAt = m_remoteFrees;
+        }
+        else {
+            arena->setNext(last, batch.first);
+            batch.first = first;
+            batch.count += count;
+        }
+        if(batch.count >= transferBatch) {
+            flushTransfer(batch);
+        }
+        if(m_remoteFrees >= m_nextTransferSweep) {
+            flushStaleTransfers();
+        }
+    }
+
+    /**
+     * Hands back the batches that haven't filled within transferAge of our
+     * remote frees, so a thread that keeps freeing into other classes doesn't
+     * sit on the owners' slots. Runs once every transferBatch remote frees.
+     */
+    void flushStaleTransfers() {
+        m_nextTransferSweep = m_remoteFrees + transferBatch;
+        for(Transfer& batch : m_transfers) {
+            if(batch.arena != nullptr && m_remoteFrees - batch.startedAt >= transferAge) {
+                flushTransfer(batch);
+            }
+        }
+    }
+
+    /**
+     * Hands back every unfinished batch. Called on our own slow paths, so a
+     * thread that frees other threads' items is never long on one without
+     * handing them back.
+     */
+    void flushTransfers() {
+        for(Transfer& batch : m_transfers) {
+            flushTransfer(batch);
+        }
+    }
+
+    /**
+     * Hands a batch back to its arena, telling the owner if it's retired.
+     */
+    static void flushTransfer(Transfer& batch) {
+        if(batch.arena == nullptr) {
+            return;
+        }
+        if(batch.arena->remoteFree(batch.first, batch.last)) {
+            batch.arena->owner()->delay(batch.arena);
+        }
+        batch.arena = nullptr;
+    }
+
+    /**
+     * Maps a BigAlloc, aligned to `alignment` (a power of two), or reuses a
+     * cached one, and counts it.
+     */
+    void* allocBig(size_t bytes, bool zeroed = false, size_t alignment = sizeof(BigAlloc)) {
+        flushTransfers();
+        void* result = reuseSpan(bytes, alignment);
+        if(result != nullptr) {
+            // Cached spans are always dirty.
+            if(zeroed) {
+                memset(result, 0, bytes);
             }
-            bytes = (i < tmp) ? i << 1 : i;
-            arena_index = (i < tmp) ? arena_index + 1 : arena_index;
-            arena_index -= 3;
         }
-        if(m_arenas[arena_index] == nullptr) {
-            m_arenas[arena_index] = Arena::create(bytes);
+        else if(zeroed && alignment <= sizeof(BigAlloc)) {
+            result = BigAlloc::allocZeroed(bytes);
         }
-        void *result = m_arenas[arena_index]->alloc();
-        if(result == nullptr) {
+        else {
+            result = BigAlloc::alloc(bytes, alignment);
+            if(zeroed && result != nullptr) {
+                memset(result, 0, bytes);
+            }
+        }
+        if(result != nullptr) {
+            m_stats.bigAllocs.add(1);
+            m_stats.bigBytesAllocated.add(BigAlloc::size(result));
+        }
+        return result;
+    }
+
+    /**
+     * Checks a BigAlloc that's being freed, and takes it out of the heap
+     * profile if it was sampled. Returns how it was sampled.
+     */
+    static uint32_t forgetBig(void* ptr) {
+        BigAlloc::check(ptr);
+        uint32_t sample = BigAlloc::sample(ptr);
+        if(sample == BigAlloc::cachedSpan) {
+            heapCorruption("double free of a BigAlloc", ptr);
+        }
+        if(sample != BigAlloc::unsampled) {
+            size_t bytes;
+            HeapProfiler::forget(ptr, bytes);
+        }
+        return sample;
+    }
+
+    void freeBig(void* ptr) {
+        uint32_t sample = forgetBig(ptr);
+        if(sample != BigAlloc::unsampled) {
+            if(sample != BigAlloc::sampledBig) {
+                // A sampled item, which was served from pages of its own.
+                tally(m_stats.classes[sample].frees, 1);
+                cacheSpan(ptr);
+                return;
+            }
+        }
+        m_stats.bigFrees.add(1);
+        m_stats.bigBytesFreed.add(BigAlloc::size(ptr));
+        cacheSpan(ptr);
+    }
+
+    /**
+     * Keeps a freed medium BigAlloc's span whole, mapped and registered, to be
+     * handed out again by reuseSpan() without going back to the PageReserve
+     * (and its lock), if there's room for it under Policy::spanCachePages.
+     * Otherwise it's deallocated.
+     */
+    void cacheSpan(void* ptr) {
+        size_t pages = BigAlloc::spanPages(ptr);
+        if(pages != 0 && pages <= Policy::spanCachePages) {
+            std::lock_guard<std::mutex> guard(m_cacheLock);
+            if(m_spanPages + pages <= Policy::spanCachePages) {
+                uint64_t now = monotonicMillis();
+                m_spans[pages] = BigAlloc::cache(ptr, m_spans[pages], now);
+                m_spanPages += pages;
+                purgeLocked(now, false);
+                return;
+            }
+        }
+        MMapObject::dealloc(ptr);
+    }
+
+    /**
+     * Makes a BigAlloc of `bytes` aligned to `alignment` out of the newest
+     * cached span with the pages it needs, or returns null if there isn't one.
+     */
+    void* reuseSpan(size_t bytes, size_t alignment) {
+        size_t pages = BigAlloc::spanPages(bytes, alignment);
+        if(pages == 0 || pages > Policy::spanCachePages) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> guard(m_cacheLock);
+        BigAlloc* span = m_spans[pages];
+        if(span == nullptr) {
+            return nullptr;
+        }
+        m_spans[pages] = span->nextCached();
+        m_spanPages -= pages;
+        return BigAlloc::reuse(span, bytes, alignment);
+    }
+
+    /**
+     * Returns the arena to allocate the given class from, taking a new one if
+     * there isn't a current one. Returns null if that fails.
+     */
+    Arena* current(size_t arena_index) {
+        Arena* arena = m_arenas[arena_index];
+        if(arena == nullptr) {
+            // Reuse a partially free or cached empty arena before mapping a new
+            // one, picking up retired arenas other threads freed into first.
+            flushTransfers();
+            collectDelayed();
+            arena = m_partial[arena_index];
+            if(arena != nullptr) {
+                arena->unlink(m_partial[arena_index]);
+            }
+            else {
+                std::lock_guard<std::mutex> guard(m_cacheLock);
+                purgeLocked(monotonicMillis(), false);
+                arena = m_empty[arena_index];
+                if(arena != nullptr) {
+                    arena->unlink(m_empty[arena_index]);
+                    m_emptyCount[arena_index]--;
+                }
+                else if(m_emptyOverflowed[arena_index]) {
+                    // We're about to create an arena we could have kept.
+                    m_emptyOverflowed[arena_index] = false;
+                    if(emptyLimit(arena_index) < emptyArenaCacheSize) {
+                        m_emptyGrowth[arena_index]++;
+                    }
+                }
+            }
+            if(arena == nullptr) {
+                arena = Arena::create(SizeClass::size(arena_index), this, SizeClass::spanPages(arena_index));
+                if(arena == nullptr) {
+                    return nullptr;
+                }
+                std::lock_guard<std::mutex> guard(m_cacheLock);
+                arena->linkOwned(m_owned);
+                m_stats.classes[arena_index].arenasCreated.add(1);
+            }
+            m_arenas[arena_index] = arena;
+        }
+        return arena;
+    }
+
+    /**
+     * Stops allocating from the given class's current arena if it just filled up.
+     */
+    void retireIfFull(Arena* arena, size_t arena_index) {
+        if(arena->full() && arena->retire()) {
+            // Full arenas are forgotten here until one of their items is freed.
             m_arenas[arena_index] = nullptr;
         }
+    }
+
+    /**
+     * Takes back the retired arenas other threads have freed into, collecting
+     * their remote frees.
+     */
+    void collectDelayed() {
+        Arena* arena = m_delayed.exchange(nullptr, std::memory_order_acquire);
+        while(arena != nullptr) {
+            Arena* next = arena->nextDelayed();
+            size_t arena_index = SizeClass::index(arena->arenaSize());
+            arena->reclaim();
+            if(arena->collectRemote()) {
+                releaseEmpty(arena, arena_index);
+            }
+            else {
+                arena->link(m_partial[arena_index]);
+            }
+            arena = next;
+        }
+    }
+
+public:
+    // How many empty arenas are cached per size class.
+    static constexpr size_t emptyArenaCacheSize = Policy::emptyArenaCache;
+
+    // The most remote frees handed back at once.
+    static constexpr size_t transferBatch = Policy::transferBatch;
+
+    // How many of a store's remote frees a batch may wait through before it's
+    // handed back unfinished.
+    static constexpr uint64_t transferAge = 4 * transferBatch;
+
+    // How long cached empty arenas live, in milliseconds.
+    static constexpr uint64_t decayMillis = MALLOC_DECAY_MS;
+
+    /**
+     * Returns the calling thread's store, creating it on first use.
+     */
+    static BasicArenaStore* local();
+
+    /**
+     * The list of every store there has ever been, newest first. Stores are
+     * never unmapped, so walking it is always safe.
+     */
+    static BasicArenaStore* first();
+
+    BasicArenaStore* nextStore() {
+        return m_nextStore;
+    }
+
+    void setNextStore(BasicArenaStore* next) {
+        m_nextStore = next;
+    }
+
+    BasicArenaStore* nextAbandoned() {
+        return m_nextAbandoned;
+    }
+
+    void setNextAbandoned(BasicArenaStore* next) {
+        m_nextAbandoned = next;
+    }
+
+    /**
+     * How many empty arenas of the given class this store caches at most, for
+     * now.
+     */
+    size_t emptyLimit(size_t arena_index) const {
+        return 1 + m_emptyGrowth[arena_index];
+    }
+
+    /**
+     * How many frees of the given class this store has yet to hand back.
+     */
+    size_t pendingTransfers(size_t arena_index) const {
+        return m_transfers[arena_index].arena != nullptr ? m_transfers[arena_index].count : 0;
+    }
+
+    const Stats& stats() {
+        return m_stats;
+    }
+
+    /**
+     * Draws a new sample countdown, e.g. after the sampling rate changed.
+     */
+    void resetSampling() {
+        if(m_sampleState != 0) {
+            m_untilSample = HeapProfiler::nextSample(m_sampleState);
+        }
+    }
+
+    /**
+     * Allocates `bytes` bytes of data. If the data is too large to fit in an arena,
+     * it will be allocated using BigAlloc. Every so often the allocation is
+     * sampled for the heap profile; see HeapProfiler.
+     */
+    void* alloc(size_t bytes) {
+        if(countDown(bytes)) {
+            return allocSampled(bytes, bytes <= SizeClass::maxSize ? SizeClass::index(bytes) : SizeClass::count);
+        }
+        return allocItem(bytes);
+    }
+
+    /**
+     * Like alloc(), but the data reads as zero, for calloc(). Memory known to be
+     * untouched since it was mapped isn't cleared, so it's only faulted in when
+     * the caller gets to it.
+     */
+    void* allocZeroed(size_t bytes) {
+        if(countDown(bytes)) {
+            return allocSampled(bytes, bytes <= SizeClass::maxSize ? SizeClass::index(bytes) : SizeClass::count, true);
+        }
+        return allocItem(bytes, true);
+    }
+
+    /**
+     * Like alloc() (or allocZeroed() if `zeroed` is set), but the data is
+     * aligned to `alignment`, a power of two. Small requests come from the
+     * first class whose slots are aligned that well, and the rest are BigAllocs
+     * padded out to it. Either way they're counted, sampled and traced under
+     * the size asked for.
+     */
+    void* allocAligned(size_t bytes, size_t alignment, bool zeroed = false) {
+        size_t arena_index = bytes <= SizeClass::maxSize ? SizeClass::alignedIndex(bytes, alignment) : SizeClass::count;
+        if(countDown(bytes)) {
+            return allocSampled(bytes, arena_index, zeroed, alignment);
+        }
+        if(arena_index == SizeClass::count) {
+            return allocBig(bytes, zeroed, alignment);
+        }
+        return allocIn(arena_index, bytes, zeroed);
+    }
+
+    /**
+     * Counts a request of `bytes` off the sample countdown, in signed
+     * arithmetic, and returns whether it ran out. Requests bigger than any
+     * object may map are going to fail, so they're neither counted nor sampled.
+     */
+    bool countDown(size_t bytes) {
+        static_assert(MMapObject::maxSize <= INT64_MAX, "Requests that may succeed fit the countdown");
+        if(bytes > MMapObject::maxSize) {
+            return false;
+        }
+        m_untilSample -= static_cast<int64_t>(bytes);
+        return m_untilSample < 0;
+    }
+
+    /**
+     * Called from alloc() when the sample countdown runs out. Draws the next
+     * countdown and allocates the item as a sample, which gets its own pages
+     * (with its data as far in as an arena's slots start, so it's aligned like
+     * any of them) so free() can tell it apart. The item would have come from
+     * class `arena_index`, or been a BigAlloc aligned to `alignment` if that's
+     * SizeClass::count. Kept out of line so the countdown is all alloc() pays.
+     */
+    __attribute__((noinline)) void* allocSampled(size_t bytes, size_t arena_index, bool zeroed = false,
+            size_t alignment = sizeof(BigAlloc)) {
+        bool first = m_sampleState == 0;
+        if(first) {
+            m_sampleState = reinterpret_cast<uintptr_t>(this) ^ monotonicMillis() ^ 1;
+        }
+        m_untilSample = HeapProfiler::nextSample(m_sampleState);
+        if(first) {
+            // The countdown started at zero, so this isn't a real sample.
+            return arena_index < SizeClass::count ? allocIn(arena_index, bytes, zeroed) : allocBig(bytes, zeroed, alignment);
+        }
+
+        if(arena_index == SizeClass::count) {
+            void* result = allocBig(bytes, zeroed, alignment);
+            if(result != nullptr && HeapProfiler::record(result, bytes)) {
+                BigAlloc::setSample(result, BigAlloc::sampledBig);
+            }
+            return result;
+        }
+        void* result = BigAlloc::allocAt(bytes, sizeof(Arena));
+        if(result == nullptr) {
+            return nullptr;
+        }
+        if(!HeapProfiler::record(result, bytes)) {
+            MMapObject::dealloc(result);
+            return allocIn(arena_index, bytes, zeroed);
+        }
+        if(zeroed) {
+            memset(result, 0, bytes);
+        }
+        BigAlloc::setSample(result, arena_index);
+        tally(m_stats.classes[arena_index].allocs, 1);
+        tally(m_stats.classes[arena_index].bytesRequested, bytes);
+        return result;
+    }
+
+    /**
+     * alloc() without the sampling, or allocZeroed() if `zeroed` is set.
+     */
+    void* allocItem(size_t bytes, bool zeroed = false) {
+        if(bytes > SizeClass::maxSize) {
+            return allocBig(bytes, zeroed);
+        }
+        return allocIn(SizeClass::index(bytes), bytes, zeroed);
+    }
+
+    /**
+     * Allocates an item of class `arena_index` for a request of `bytes` bytes.
+     */
+    void* allocIn(size_t arena_index, size_t bytes, bool zeroed = false) {
+        Arena* arena = current(arena_index);
+        if(arena == nullptr) {
+            return nullptr;
+        }
+        void* result = zeroed ? arena->allocZeroed() : arena->alloc();
+        retireIfFull(arena, arena_index);
+        tally(m_stats.classes[arena_index].allocs, 1);
+        tally(m_stats.classes[arena_index].bytesRequested, bytes);
+        return result;
+    }
+
+    /**
+     * Allocates `count` items of `bytes` bytes into `out`, looking up the class
+     * once and filling as much as possible from each arena at a time. Returns
+     * how many were allocated, which is less than `count` only if we ran out of
+     * memory.
+     */
+    size_t allocBatch(size_t bytes, size_t count, void** out) {
+        size_t result = 0;
+        if(bytes > SizeClass::maxSize) {
+            while(result < count && (out[result] = allocBig(bytes)) != nullptr) {
+                result++;
+            }
+            return result;
+        }
+        size_t arena_index = SizeClass::index(bytes);
+        while(result < count) {
+            Arena* arena = current(arena_index);
+            if(arena == nullptr) {
+                break;
+            }
+            result += arena->allocBatch(out + result, count - result);
+            retireIfFull(arena, arena_index);
+        }
+        tally(m_stats.classes[arena_index].allocs, result);
+        tally(m_stats.classes[arena_index].bytesRequested, bytes * result);
         return result;
     }
 
     /**
-     * Determines the allocation type for the given pointer and calls
-     * the appropriate free method.
+     * Determines the allocation type for the given pointer from the PageMap and
+     * calls the appropriate free method. Items owned by another store are handed
+     * back to it.
      */
     void free(void* ptr) {
-        // TODO: implement free.
-        MMapObject *myMmap = reinterpret_cast<MMapObject *>(ptr);
-        if(myMmap->arenaSize() == 0) {
-            return MMapObject::dealloc((void *)myMmap);
+        const PageMap::Entry* entry = PageMap::lookup(ptr);
+        if(Policy::hardened && entry == nullptr) {
+            heapCorruption("free of a pointer that isn't ours", ptr);
+        }
+        if(entry->arenaSize == 0) {
+            return freeBig(ptr);
+        }
+        Arena *myArena = static_cast<Arena *>(entry->span);
+        if(entry->owner != this) {
+            transfer(myArena, SizeClass::index(entry->arenaSize), ptr, ptr, 1);
+            return;
+        }
+        freeLocal(myArena, ptr, ptr, 1);
+    }
+
+    /**
+     * Frees `count` pointers at once. Each run of consecutive pointers into the
+     * same arena is chained together and handed back with one PageMap lookup,
+     * joining the batch for that arena if another store owns it. Null pointers
+     * are skipped.
+     */
+    void freeBatch(void** ptrs, size_t count) {
+        size_t i = 0;
+        while(i < count) {
+            void* first = ptrs[i++];
+            if(first == nullptr) {
+                continue;
+            }
+            const PageMap::Entry* entry = PageMap::lookup(first);
+            if(Policy::hardened && entry == nullptr) {
+                heapCorruption("free of a pointer that isn't ours", first);
+            }
+            if(entry->arenaSize == 0) {
+                freeBig(first);
+                continue;
+            }
+            Arena* arena = static_cast<Arena *>(entry->span);
+            void* last = first;
+            int run = 1;
+            while(i < count && ptrs[i] != nullptr && arena->contains(ptrs[i])) {
+                arena->setNext(last, ptrs[i]);
+                last = ptrs[i++];
+                run++;
+            }
+            if(entry->owner != this) {
+                transfer(arena, SizeClass::index(entry->arenaSize), first, last, run);
+                continue;
+            }
+            freeLocal(arena, first, last, run);
+        }
+    }
+
+    /**
+     * free() for a thread that has no store, because mapping one failed. Items
+     * go straight back to the store that owns them as remote frees, and
+     * BigAllocs are deallocated without being counted.
+     */
+    static void freeWithoutStore(void* ptr) {
+        const PageMap::Entry* entry = PageMap::lookup(ptr);
+        if(Policy::hardened && entry == nullptr) {
+            heapCorruption("free of a pointer that isn't ours", ptr);
+        }
+        if(entry->arenaSize == 0) {
+            forgetBig(ptr);
+            MMapObject::dealloc(ptr);
+            return;
+        }
+        Arena* arena = static_cast<Arena *>(entry->span);
+        if(arena->remoteFree(ptr, ptr)) {
+            arena->owner()->delay(arena);
+        }
+    }
+
+    /**
+     * Resizes the BigAlloc whose data is at `ptr` to hold `bytes` without
+     * copying (see BigAlloc::realloc()), counting the change in its size.
+     * Returns the new data pointer, or null if the caller has to allocate,
+     * copy and free instead.
+     */
+    void* reallocBig(void* ptr, size_t bytes) {
+        size_t old = BigAlloc::size(ptr);
+        void* result = BigAlloc::realloc(ptr, bytes);
+        if(result != nullptr) {
+            m_stats.bigBytesFreed.add(old);
+            m_stats.bigBytesAllocated.add(BigAlloc::size(result));
+        }
+        return result;
+    }
+
+    /**
+     * free() for callers that know the size they asked for. Items going back to
+     * the current arena of that size's class are recognized from the arena's
+     * bounds, skipping the PageMap lookup; anything else goes through free().
+     */
+    void freeSized(void* ptr, size_t bytes) {
+        if(bytes <= SizeClass::maxSize) {
+            Arena* arena = m_arenas[SizeClass::index(bytes)];
+            if(arena != nullptr && arena->contains(ptr)) {
+                // The current arena is never listed, so there's nothing to update.
+                arena->free(ptr);
+                tally(m_stats.classes[SizeClass::index(bytes)].frees, 1);
+                return;
+            }
+        }
+        free(ptr);
+    }
+
+    /**
+     * Hands back our unfinished batches of other stores' items, then processes
+     * every item other threads have handed back to this store so far, releasing
+     * any arenas that are no longer in use, cached ones and spans included.
+     */
+    void collect() {
+        flushTransfers();
+        collectDelayed();
+        std::lock_guard<std::mutex> guard(m_cacheLock);
+        purgeLocked(monotonicMillis(), true);
+        for(size_t i = 0; i < SizeClass::count; i++) {
+            if(m_arenas[i] != nullptr && m_arenas[i]->collectRemote()) {
+                releaseArena(m_arenas[i], i);
+                m_arenas[i] = nullptr;
+            }
+            Arena* arena = m_partial[i];
+            while(arena != nullptr) {
+                Arena* next = arena->nextArena();
+                if(arena->collectRemote()) {
+                    arena->unlink(m_partial[i]);
+                    releaseArena(arena, i);
+                }
+                arena = next;
+            }
         }
-        Arena *myArena = reinterpret_cast<Arena *>(myMmap);
-        if(myArena->free()) {
-            return MMapObject::dealloc((void *)myArena);
+    }
+
+    /**
+     * Calls `visit` with every item allocated from this store's arenas and not
+     * yet freed, and its slot size. Frees by other threads that haven't been
+     * handed back and collected yet are still visited. Only the owner may call
+     * this.
+     */
+    template<typename Visit>
+    size_t forEachLive(Visit visit) {
+        std::lock_guard<std::mutex> guard(m_cacheLock);
+        size_t result = 0;
+        for(Arena* arena = m_owned; arena != nullptr; arena = arena->nextOwned()) {
+            size_t bytes = arena->arenaSize();
+            arena->forEachLive([&](void* item) {
+                visit(item, bytes);
+                result++;
+            });
         }
+        return result;
+    }
+
+    /**
+     * Releases this store's cached empty arenas and spans that have decayed, or
+     * all of them. Unlike everything else here, this may be called from any thread.
+     */
+    void purgeCaches(bool all) {
+        std::lock_guard<std::mutex> guard(m_cacheLock);
+        purgeLocked(monotonicMillis(), all);
+    }
+
+    /**
+     * Takes the cache lock before a fork(), and drops it in the parent and the
+     * child afterwards, since the background purger may hold it meanwhile.
+     */
+    void lockForFork() {
+        m_cacheLock.lock();
+    }
+
+    void unlockAfterFork() {
+        m_cacheLock.unlock();
     }
 };
 
+// Threads' stores are made and listed in Malloc.cpp, for the build's policy
+// only. Stores of other policies are made and looked after by their users.
+template<> ArenaStore* ArenaStore::local();
+template<> ArenaStore* ArenaStore::first();
+
 void* myMalloc(size_t n);
-void myFree(void* ptr);
\ No newline at end of file
+void myFree(void* ptr);
+
+/**
+ * myFree() for a pointer that came from myMalloc(n), as from a C++14 sized
+ * delete. Knowing the size lets the common case skip the PageMap lookup.
+ */
+void myFreeSized(void* ptr, size_t n);
+
+/**
+ * Allocates `count` blocks of `n` bytes each into `out`, as if by calling
+ * myMalloc(n) `count` times but with the per-call work done once. Returns how
+ * many were allocated; fewer than `count` means we ran out of memory.
+ */
+size_t myMallocBatch(size_t n, size_t count, void** out);
+
+/**
+ * Frees `count` pointers, as if by calling myFree() on each. Pointers that came
+ * from the same arena, as from one myMallocBatch() call, are freed together.
+ */
+void myFreeBatch(void** ptrs, size_t count);
+
+/**
+ * Your special drop-in replacement for realloc(). Large blocks are moved with
+ * mremap rather than copied.
+ */
+void* myRealloc(void* ptr, size_t n);
+
+/**
+ * Your special drop-in replacement for calloc(). Memory that comes straight
+ * from mmap is already zero, so only recycled memory gets cleared.
+ */
+void* myCalloc(size_t count, size_t n);
+
+/**
+ * Your special drop-in replacement for aligned_alloc(). `alignment` must be a
+ * power of two. Small requests come from the first size class whose slots are
+ * all aligned, anything else from a padded BigAlloc.
+ */
+void* myAlignedAlloc(size_t alignment, size_t n);
+
+/**
+ * Allocates `n` bytes on cache lines of their own, so that nothing else
+ * allocated shares them. Use this for data different threads write to, like
+ * per-thread counters, to avoid false sharing.
+ */
+void* myMallocCacheAligned(size_t n);
+
+/**
+ * Like myMalloc() and myCalloc(), but aligned to alignof(max_align_t) as
+ * malloc() promises, for the preloaded library. Requests are counted, sampled
+ * and traced under the size asked for, not the class they're rounded up to.
+ */
+void* myMallocMaxAligned(size_t n);
+void* myCallocMaxAligned(size_t count, size_t n);
+
+/**
+ * Your special drop-in replacement for posix_memalign().
+ */
+int myPosixMemalign(void** out, size_t alignment, size_t n);
+
+/**
+ * Your special drop-in replacement for malloc_usable_size(): the number of
+ * bytes that can be used at ptr, which may be more than were asked for.
+ */
+size_t myMallocUsableSize(void* ptr);
+
+/**
+ * Hands back the calling thread's unfinished batches of frees of other threads'
+ * memory, processes frees other threads have made of memory the calling thread
+ * allocated, and releases the calling thread's empty arenas. Remote frees are
+ * otherwise handed back a batch at a time and picked up lazily the next time
+ * the calling thread needs a new arena, and cached arenas once they decay.
+ */
+void myMallocCollect();
+
+/**
+ * Gives back as much memory as can be given back now: collects the calling
+ * thread's store as myMallocCollect() does, releases every thread's cached
+ * empty arenas, and decommits every free page in the PageReserve. Returns how
+ * many bytes that handed back to the OS.
+ */
+size_t myMallocTrim();
+
+/**
+ * Starts (or stops) a background thread that releases cached empty arenas and
+ * free PageReserve pages as they decay, even in threads that have gone idle,
+ * so RSS falls back after a spike without any work on the allocation path.
+ * Returns false if the thread couldn't be started. Without it memory only
+ * decays when the thread that cached it allocates or frees again.
+ */
+bool myMallocBackgroundPurge(bool enable);
+
+/**
+ * Calls `visit` with every item the calling thread allocated from an arena and
+ * hasn't freed, with its usable size and `arg`, and returns how many there
+ * were. Frees by other threads the calling thread hasn't collected yet (see
+ * myMallocCollect()) still count. Each arena is walked through its slot
+ * bitmap, 64 slots at a time. BigAllocs and other threads' arenas aren't
+ * walked, since only their owners may read them. `visit` must not allocate
+ * or free. Nothing is visited if built with MALLOC_SLOT_BITMAP=0.
+ */
+size_t myMallocWalkLive(void (*visit)(void* ptr, size_t size, void* arg), void* arg);
+
+/**
+ * The number of bytes in the process currently backed by transparent huge
+ * pages, according to the kernel (AnonHugePages in /proc/self/smaps_rollup).
+ * Returns zero if it can't tell.
+ */
+size_t myMallocHugePageBytes();
+
+/**
+ * Statistics for one size class, summed over every thread. Counts are since
+ * the process started; "live" and "reserved" figures are current.
+ */
+struct MallocClassStats {
+    // The class's slot size.
+    size_t size;
+    uint64_t allocs;
+    // All frees, including crossThreadFrees.
+    uint64_t frees;
+    // Frees by a thread other than the one that allocated the item.
+    uint64_t crossThreadFrees;
+    // Slots allocated and not yet freed.
+    uint64_t liveSlots;
+    // Arenas currently mapped, including cached empty ones.
+    uint64_t arenas;
+    // What callers asked for, against the slot bytes it took to serve them.
+    uint64_t bytesRequested;
+    uint64_t bytesAllocated;
+    // The bytes of the arenas currently mapped.
+    uint64_t bytesReserved;
+};
+
+/**
+ * A snapshot of the allocator statistics, from myMallocStats().
+ */
+struct MallocStats {
+    MallocClassStats classes[SizeClass::count];
+
+    // BigAllocs made and freed, and the bytes still mapped for them.
+    uint64_t bigAllocs;
+    uint64_t bigFrees;
+    uint64_t bigBytesLive;
+
+    // Totals over every class and BigAllocs.
+    uint64_t bytesRequested;
+    uint64_t bytesAllocated;
+    uint64_t bytesReserved;
+
+    // System calls: direct mmap (and mremap) and munmap calls, plus the
+    // PageReserve's own mmap, mprotect and madvise calls.
+    uint64_t mmapCalls;
+    uint64_t munmapCalls;
+    uint64_t reserveSyscalls;
+
+    // The stores there have been, each serving one thread at a time (exited
+    // threads' stores are reused), and MMapObject::outstandingPages().
+    uint64_t threads;
+    uint64_t outstandingPages;
+};
+
+/**
+ * Gathers the allocator statistics. Each thread counts into its own store, so
+ * keeping them costs no shared writes; this sums every store's counters. Other
+ * threads keep running meanwhile, so the snapshot isn't atomic.
+ */
+MallocStats myMallocStats();
+
+/**
+ * Formats myMallocStats() as text, or as a JSON object if `json` is set, into
+ * `buffer` without allocating. Returns the length of the whole dump like
+ * snprintf() does, even if it had to be truncated to fit.
+ */
+size_t myMallocStatsDump(char* buffer, size_t size, bool json);
+
+/**
+ * Sets the mean number of bytes allocated between heap profile samples, or
+ * turns sampling off if it's zero. The calling thread starts counting afresh;
+ * others pick it up at their next sample. Defaults to MALLOC_SAMPLE_BYTES.
+ */
+void myMallocSetSampleRate(size_t bytes);
+
+/**
+ * Writes the heap profile, a stack for every live sampled allocation and the
+ * bytes it stands for, to file descriptor `fd` in collapsed stack format (see
+ * HeapProfiler::dump()). Returns how many samples it wrote.
+ */
+size_t myMallocProfileDump(int fd);
+
+/**
+ * Starts recording every allocation and free into a trace of the last `events`
+ * of them at `path`, for the benchmarks' replay (see Trace). Returns false if
+ * the file can't be made or a trace is already running.
+ */
+bool myMallocTraceStart(const char* path, size_t events);
+
+/**
+ * Stops recording the trace.
+ */
+void myMallocTraceStop();
+
+/**
+ * Handlers for pthread_atfork(). Other threads may hold the allocator's locks
+ * at the moment a process forks, and the child has only the forking thread to
+ * release them, so these take every lock the allocator might need before the
+ * fork and release them in both processes after it. The preloaded library
+ * registers them; programs that fork while other threads allocate should too.
+ */
+void myMallocPrepareFork();
+void myMallocParentAfterFork();
+void myMallocChildAfterFork();
\ No newline at end of file
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stddef.h>
+
+// The arena item sizes, smallest first. Each must be a multiple of 8 and the
+// largest is the biggest request served from an arena. The default steps by a
+// quarter of each power of two, so no slot wastes more than 25% (bar the 16
+// byte class, kept to make room for 8 byte requests). Build with e.g.
+// -DMALLOC_SIZE_CLASSES=8,16,32,64 to fit the classes to a different workload.
+#ifndef MALLOC_SIZE_CLASSES
+#define MALLOC_SIZE_CLASSES \
+    8, 16, 24, 32, 48, 64, 80, 96, 112, 128, \
+    160, 192, 224, 256, 320, 384, 448, 512, \
+    640, 768, 896, 1024
+#endif
+
+// The most emptied arenas each store keeps per size class to reuse before
+// creating new ones. Each class starts out keeping one and earns more by
+// missing them; anything over its share goes straight back to the PageReserve.
+#ifndef MALLOC_EMPTY_ARENA_CACHE
+#define MALLOC_EMPTY_ARENA_CACHE 4
+#endif
+
+// How many pages of freed medium BigAllocs each store keeps, whole and still
+// registered, to hand out again for allocations of the same page count without
+// taking the PageReserve's lock. Like empty arenas they're released as they
+// decay, or when the store is collected or trimmed.
+#ifndef MALLOC_SPAN_CACHE_PAGES
+#define MALLOC_SPAN_CACHE_PAGES 64
+#endif
+
+// How many frees of another store's items, from one of its arenas, a store
+// chains together before handing them back with a single compare and swap.
+// Unfinished batches go back whenever the store leaves its fast path, or once
+// it has made four batches' worth of remote frees since starting one.
+#ifndef MALLOC_TRANSFER_BATCH
+#define MALLOC_TRANSFER_BATCH 32
+#endif
+
+// Whether to check for heap corruption, as cheaply as we can: free list links
+// are XORed with a per-arena secret and checked as they're followed, frees are
+// checked against the slot bitmap, BigAllocs end in a canary that's checked
+// when they're freed, and those too big for the PageReserve are followed by a
+// PROT_NONE guard page. Anything found is reported on stderr and raises
+// SIGTRAP. Build with -DMALLOC_HARDENED=1, and see `make bench-hardened` for
+// what it costs.
+#ifndef MALLOC_HARDENED
+#define MALLOC_HARDENED 0
+#endif
+
+// Whether stores count their allocations and frees for myMallocStats(). The
+// counters are single writer, but they're still a few stores on every call, so
+// build with -DMALLOC_STATS=0 to leave them out. Arenas and BigAllocs are
+// always counted.
+#ifndef MALLOC_STATS
+#define MALLOC_STATS 1
+#endif
+
+/**
+ * The compile-time configuration of an ArenaStore: its size classes, how big
+ * their arenas get, how much each store caches, and which checks and counters
+ * are built in. BasicArenaStore and SizeClassTable are templates over one of
+ * these, and features a policy leaves out compile out of the hot path.
+ *
+ * DefaultPolicy takes everything from the MALLOC_* macros above. A policy
+ * tuned for something else derives from it and overrides what it changes.
+ * Pick the build's with -DMALLOC_POLICY=LatencyPolicy, say.
+ */
+struct DefaultPolicy {
+    // What the benchmarks call this build.
+    static constexpr const char* name = "mymalloc";
+
+    // The arena item sizes, as for MALLOC_SIZE_CLASSES.
+    static constexpr size_t sizes[] = { MALLOC_SIZE_CLASSES };
+
+    // Arenas use as many pages, up to maxSpanPages, as it takes to keep the
+    // header and the unusable tail under maxSpanWastePercent of the span.
+    static constexpr size_t maxSpanPages = 8;
+    static constexpr size_t maxSpanWastePercent = 6;
+
+    // How many empty arenas each store caches per class at most, and how many
+    // remote frees it hands back at once.
+    static constexpr size_t emptyArenaCache = MALLOC_EMPTY_ARENA_CACHE;
+    static constexpr size_t transferBatch = MALLOC_TRANSFER_BATCH;
+
+    // How many pages of freed medium BigAllocs each store caches at most.
+    static constexpr size_t spanCachePages = MALLOC_SPAN_CACHE_PAGES;
+
+    static constexpr bool hardened = MALLOC_HARDENED;
+    static constexpr bool stats = MALLOC_STATS;
+};
+
+/**
+ * For latency critical services: stores hold on to more empty arenas and freed
+ * medium spans and hand remote frees back less often, so fewer calls leave the
+ * fast path, and the per-call counters are left out.
+ */
+struct LatencyPolicy : DefaultPolicy {
+    static constexpr const char* name = "latency";
+    static constexpr size_t emptyArenaCache = 16;
+    static constexpr size_t transferBatch = 64;
+    static constexpr size_t spanCachePages = 256;
+    static constexpr bool stats = false;
+};
+
+/**
+ * For memory constrained workers: size classes step by an eighth of each power
+ * of two, so no slot wastes more than 12.5%, arenas stay small so less memory
+ * is stranded in partly used ones, and nothing more is cached than has to be.
+ */
+struct CompactPolicy : DefaultPolicy {
+    static constexpr const char* name = "compact";
+    static constexpr size_t sizes[] = {
+        8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120, 128,
+        144, 160, 176, 192, 208, 224, 240, 256, 288, 320, 352, 384, 416, 448, 480, 512,
+        576, 640, 704, 768, 832, 896, 960, 1024
+    };
+    static constexpr size_t maxSpanPages = 2;
+    static constexpr size_t maxSpanWastePercent = 12;
+    static constexpr size_t emptyArenaCache = 1;
+    static constexpr size_t transferBatch = 8;
+    static constexpr size_t spanCachePages = 32;
+};
+
+// The policy the allocator is built with.
+#ifndef MALLOC_POLICY
+#define MALLOC_POLICY DefaultPolicy
+#endif
+
+using MallocPolicy = MALLOC_POLICY;
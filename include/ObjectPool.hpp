@@ -0,0 +1,188 @@
+#pragma once
+
+#include <Malloc.hpp>
+#include <new>
+#include <stddef.h>
+#include <utility>
+
+/**
+ * A pool of fixed-size slots for objects of type T, for hot paths that
+ * allocate one kind of node over and over. The slot size is a compile time
+ * constant and the pool keeps its own list of arenas, so allocate() is a free
+ * list pop (or a bump) with no size class lookup.
+ *
+ * A pool isn't thread safe, and items must go back to the pool they came
+ * from. Its arenas are only unmapped once every item has been deallocated.
+ */
+template<typename T>
+class ObjectPool {
+    static constexpr size_t itemSize = sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*);
+
+    static_assert(alignof(T) <= alignof(max_align_t) && sizeof(Arena) % alignof(T) == 0,
+        "Arena slots can't be aligned for T");
+
+public:
+    /**
+     * The size of each slot: big enough for a T or a free list link, and
+     * rounded up so every slot is aligned for T.
+     */
+    static constexpr size_t slotSize = (itemSize + alignof(T) - 1) / alignof(T) * alignof(T);
+
+    /**
+     * The pages per arena: enough for a few dozen slots at a time, up to the
+     * largest span.
+     */
+    static constexpr size_t spanPages =
+        (sizeof(Arena) + 32 * slotSize + pageSize - 1) / pageSize < maxSpanPages
+            ? (sizeof(Arena) + 32 * slotSize + pageSize - 1) / pageSize
+            : maxSpanPages;
+
+    static_assert(sizeof(Arena) + slotSize <= spanPages * pageSize, "T is too big for an ObjectPool");
+
+private:
+    // Freed slots, linked through their first word.
+    void* m_free;
+    // The bump region left in the newest arena.
+    char* m_next;
+    char* m_end;
+    // Every arena this pool has mapped.
+    Arena* m_arenas;
+    // The number of items handed out and not yet returned.
+    size_t m_live;
+
+    T* allocateSlow() {
+        Arena* arena = Arena::create(slotSize, nullptr, spanPages);
+        if(arena == nullptr)
+            return nullptr;
+        arena->link(m_arenas);
+        m_next = arena->data() + slotSize;
+        m_end = reinterpret_cast<char*>(arena) + arena->mmapSize();
+        m_live++;
+        return reinterpret_cast<T*>(arena->data());
+    }
+
+public:
+    ObjectPool() : m_free(nullptr), m_next(nullptr), m_end(nullptr), m_arenas(nullptr), m_live(0) {
+    }
+
+    ObjectPool(const ObjectPool& other) = delete;
+    ObjectPool& operator=(const ObjectPool& other) = delete;
+
+    /**
+     * Unmaps the pool's arenas, unless items are still out, in which case
+     * they're left mapped for good.
+     */
+    ~ObjectPool() {
+        if(m_live != 0) {
+            return;
+        }
+        while(m_arenas != nullptr) {
+            Arena* arena = m_arenas;
+            arena->unlink(m_arenas);
+            MMapObject::dealloc(arena);
+        }
+    }
+
+    /**
+     * The calling thread's pool for T.
+     */
+    static ObjectPool& local() {
+        static thread_local ObjectPool pool;
+        return pool;
+    }
+
+    /**
+     * Returns uninitialized storage for one T, or null if we're out of memory.
+     */
+    T* allocate() {
+        if(m_free != nullptr) {
+            void* result = m_free;
+            m_free = *static_cast<void**>(result);
+            m_live++;
+            return static_cast<T*>(result);
+        }
+        if(m_end - m_next >= static_cast<ptrdiff_t>(slotSize)) {
+            char* result = m_next;
+            m_next += slotSize;
+            m_live++;
+            return reinterpret_cast<T*>(result);
+        }
+        return allocateSlow();
+    }
+
+    /**
+     * Returns storage from allocate() to the pool.
+     */
+    void deallocate(T* ptr) {
+        *reinterpret_cast<void**>(ptr) = m_free;
+        m_free = ptr;
+        m_live--;
+    }
+
+    /**
+     * Allocates and constructs a T, or returns null if we're out of memory.
+     */
+    template<typename... Args>
+    T* create(Args&&... args) {
+        T* ptr = allocate();
+        return ptr != nullptr ? new (ptr) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    /**
+     * Destroys and deallocates a T from create().
+     */
+    void destroy(T* ptr) {
+        ptr->~T();
+        deallocate(ptr);
+    }
+
+    /**
+     * The number of items handed out and not yet returned.
+     */
+    size_t live() {
+        return m_live;
+    }
+};
+
+/**
+ * An allocator for standard containers that serves single objects, i.e. the
+ * nodes of a std::list, std::map or std::unordered_map, from the calling
+ * thread's ObjectPool. Anything else goes to myMalloc(). Containers using it
+ * must stay on one thread.
+ */
+template<typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() noexcept {
+    }
+
+    template<class U> PoolAllocator(const PoolAllocator<U>&) noexcept {
+    }
+
+    template<class U> bool operator==(const PoolAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template<class U> bool operator!=(const PoolAllocator<U>&) const noexcept {
+        return false;
+    }
+
+    T* allocate(size_t n) {
+        void* result = n == 1 ? ObjectPool<T>::local().allocate() : myMalloc(n * sizeof(T));
+        if(result == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(result);
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        if(n == 1) {
+            ObjectPool<T>::local().deallocate(ptr);
+        }
+        else {
+            myFree(ptr);
+        }
+    }
+};
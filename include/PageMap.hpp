@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+class MMapObject;
+class ArenaOwner;
+
+/**
+ * A three level radix tree from page number (address >> 12) to the span that
+ * page belongs to. This lets free() find an allocation's metadata without
+ * assuming where its header is, and without reading the freed item's page.
+ *
+ * Nodes are mapped on demand and never freed. Lookups take no locks;
+ * registering a span only synchronizes when it has to install a new node.
+ */
+class PageMap {
+public:
+    /**
+     * What we know about a mapped page.
+     */
+    struct Entry {
+        // The MMapObject header at the start of the span containing this page.
+        MMapObject* span;
+
+        // For arenas, the store that allocates from them. Null for BigAllocs and
+        // arenas created outside of a store.
+        ArenaOwner* owner;
+
+        // The span's MMapObject::arenaSize(), i.e. zero for a BigAlloc.
+        size_t arenaSize;
+    };
+
+private:
+    static constexpr size_t pageShift = 12;
+    static constexpr size_t addressBits = 48;
+
+    static constexpr size_t leafBits = 11;
+    static constexpr size_t midBits = 12;
+    static constexpr size_t rootBits = addressBits - pageShift - leafBits - midBits;
+
+    struct Leaf {
+        Entry entries[1 << leafBits];
+    };
+
+    struct Mid {
+        std::atomic<Leaf*> leaves[1 << midBits];
+    };
+
+    static std::atomic<Mid*> s_root[1 << rootBits];
+
+    static size_t rootIndex(uintptr_t page) {
+        return page >> (leafBits + midBits);
+    }
+
+    static size_t midIndex(uintptr_t page) {
+        return (page >> leafBits) & ((1 << midBits) - 1);
+    }
+
+    static size_t leafIndex(uintptr_t page) {
+        return page & ((1 << leafBits) - 1);
+    }
+
+    /**
+     * Returns the entry for the given page, creating the nodes on the way to it
+     * if needed. Returns null if a node couldn't be mapped.
+     */
+    static Entry* entryFor(uintptr_t page);
+
+public:
+    /**
+     * Records `entry` for the `pages` pages starting at `start`. Returns false if
+     * we ran out of memory for the map itself.
+     */
+    static bool set(void* start, size_t pages, const Entry& entry);
+
+    /**
+     * Forgets the `pages` pages starting at `start`.
+     */
+    static void clear(void* start, size_t pages);
+
+    /**
+     * Returns the entry for the page containing ptr, or null if that page isn't
+     * registered.
+     */
+    static const Entry* lookup(const void* ptr) {
+        uintptr_t page = reinterpret_cast<uintptr_t>(ptr) >> pageShift;
+        if(rootIndex(page) >= (1 << rootBits)) {
+            return nullptr;
+        }
+        Mid* mid = s_root[rootIndex(page)].load(std::memory_order_acquire);
+        if(mid == nullptr) {
+            return nullptr;
+        }
+        Leaf* leaf = mid->leaves[midIndex(page)].load(std::memory_order_acquire);
+        if(leaf == nullptr) {
+            return nullptr;
+        }
+        const Entry* entry = &leaf->entries[leafIndex(page)];
+        return entry->span != nullptr ? entry : nullptr;
+    }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The most NUMA nodes the PageReserve keeps apart. Build with
+// -DMALLOC_NUMA_NODES=1 to ignore NUMA altogether.
+#ifndef MALLOC_NUMA_NODES
+#define MALLOC_NUMA_NODES 4
+#endif
+
+// Whether to back the PageReserve with transparent huge pages. Build with
+// -DMALLOC_HUGEPAGES=0 to opt out.
+#ifndef MALLOC_HUGEPAGES
+#define MALLOC_HUGEPAGES 1
+#endif
+
+/**
+ * A large block of address space reserved up front that arena spans and medium
+ * BigAllocs are carved out of, so steady-state allocation doesn't need mmap or
+ * munmap.
+ *
+ * The region starts out PROT_NONE and is committed with mprotect in batches as
+ * the bump pointer reaches it. Freed spans go onto per-size dirty lists and are
+ * handed straight back out. Spans left free decay over MALLOC_DECAY_MS and are
+ * handed to the OS with madvise(MADV_FREE), and once maxDirtyPages have piled
+ * up, spans freed on top of them are given back with madvise(MADV_DONTNEED)
+ * as they come. Either way they stay committed so they can be reused without a syscall: lazily
+ * freed ones on the clean lists, and ones given back for good on the zero
+ * lists, since like the pages the bump pointer hasn't reached yet they read as
+ * zero and aren't resident. allocSpan() says when a span is one of those, so
+ * callers can skip clearing it and don't fault it in before they use it.
+ *
+ * Free lists are linked through a side table rather than the spans themselves,
+ * so decommitting a span doesn't lose its link. madvise is only ever called
+ * with the lock dropped, on spans taken off the lists first.
+ *
+ * Spans are handed out at the size they're freed at for as long as the bump
+ * pointer lasts. Once a slice is used up, a request no free span of its size
+ * can serve is carved off the front of the smallest bigger one, and the rest
+ * goes back on the lists. Free spans are never coalesced, though, so once a
+ * slice has been split up, a request bigger than any of its free spans falls
+ * back to mmap even if there are enough free pages next to each other.
+ *
+ * On NUMA machines the reservation is split into a slice per node. Spans are
+ * handed out from the slice of the node the calling thread runs on, whose
+ * pages are committed with a preference for that node, and always go back to
+ * their own slice's free lists.
+ *
+ * The reservation is aligned to a huge page and madvised MADV_HUGEPAGE, and
+ * committed a huge page at a time, so the kernel can back it with transparent
+ * huge pages. Decaying part of a huge page splits it again.
+ */
+class PageReserve {
+public:
+    // How much address space to reserve.
+    static constexpr size_t reservationSize = size_t(1) << 30;
+
+    // Whether the reservation asks for transparent huge pages.
+    static constexpr bool hugePages = MALLOC_HUGEPAGES;
+
+    // The size of a transparent huge page.
+    static constexpr size_t hugePageSize = size_t(2) << 20;
+
+    // How many pages to commit each time the bump pointer runs out. With huge
+    // pages that's a whole one, since a partly committed one can't be huge.
+    static constexpr size_t commitBatchPages = hugePages ? hugePageSize / 4096 : 256;
+
+    // How many free, still resident pages to keep before giving freed spans
+    // straight back.
+    static constexpr size_t maxDirtyPages = 2048;
+
+    // The most NUMA nodes to keep separate slices for.
+    static constexpr size_t maxNodes = MALLOC_NUMA_NODES;
+
+    /**
+     * Returns a committed span of `pages` pages (at most maxMediumPages), or null if the reservation is
+     * exhausted and no free span is big enough (or it couldn't be made), in
+     * which case the caller should mmap.
+     * If `zero` is given, it's set to whether the span is known to read as
+     * zero, having never been touched since it was committed or given back.
+     */
+    static void* allocSpan(size_t pages, bool* zero = nullptr);
+
+    /**
+     * Returns a span handed out by allocSpan().
+     */
+    static void freeSpan(void* ptr, size_t pages);
+
+    /**
+     * Whether ptr lies inside the reservation.
+     */
+    static bool contains(const void* ptr);
+
+    /**
+     * Lazily frees the dirty spans that have decayed, as freeSpan() does every
+     * so often, for a caller that wants it to happen without a free.
+     */
+    static void purge();
+
+    /**
+     * Gives every dirty free page back to the OS now. Spans decommitted this way
+     * read back as zero. Returns how many pages that was.
+     */
+    static size_t decommit();
+
+    /**
+     * Pages of the reservation that have been committed with mprotect.
+     */
+    static size_t committedPages();
+
+    /**
+     * The number of NUMA nodes the reservation is split between, once it's been
+     * made.
+     */
+    static size_t nodes();
+
+    /**
+     * The node whose slice the given span of the reservation comes from.
+     */
+    static size_t node(const void* ptr);
+
+    /**
+     * Free pages that are still resident.
+     */
+    static size_t dirtyPages();
+
+    /**
+     * The number of mmap, mprotect and madvise calls made so far.
+     */
+    static size_t syscalls();
+
+    /**
+     * Takes the reserve's lock before a fork(), and drops it in the parent and
+     * the child afterwards, so a child forked while another thread held it
+     * doesn't deadlock on its first span.
+     */
+    static void lockForFork();
+    static void unlockAfterFork();
+};
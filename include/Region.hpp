@@ -0,0 +1,197 @@
+#pragma once
+
+#include <Malloc.hpp>
+#include <memory_resource>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A monotonic allocator for objects that all die together, like everything a
+ * request handler allocates. alloc() is a bump pointer through a chain of
+ * chunks mapped with MMapObject::alloc(), and nothing is freed until reset()
+ * or the destructor drops the lot at once. Items have no headers of their own.
+ *
+ * A Region isn't thread safe; use one per thread (or request).
+ */
+class Region {
+    class Chunk : public MMapObject {
+        // This inherits from MMapObject, so it also has the mmapSize and arenSize
+        // members as well.
+
+        // The chunk allocated before this one.
+        Chunk* m_prev;
+
+        char m_data[0];
+
+    public:
+        Chunk(const Chunk& other) = delete;
+        Chunk() = delete;
+
+        /**
+         * Maps a chunk with room for at least `bytes` bytes of items, or returns
+         * null if that's more than we could map.
+         */
+        static Chunk* create(size_t bytes, Chunk* prev) {
+            size_t size;
+            if(__builtin_add_overflow(bytes, sizeof(Chunk), &size))
+                return nullptr;
+            Chunk* chunk = static_cast<Chunk *>(MMapObject::alloc(size, 0));
+            if(chunk == nullptr)
+                return nullptr;
+            chunk->m_prev = prev;
+            return chunk;
+        }
+
+        /**
+         * Unmaps this chunk and returns the one allocated before it.
+         */
+        Chunk* release() {
+            Chunk* prev = m_prev;
+            MMapObject::dealloc(this);
+            return prev;
+        }
+
+        char* begin() {
+            return &m_data[0];
+        }
+
+        char* end() {
+            return reinterpret_cast<char*>(this) + mmapSize();
+        }
+
+        Chunk* prev() {
+            return m_prev;
+        }
+
+        void setPrev(Chunk* prev) {
+            m_prev = prev;
+        }
+    };
+
+    // The chunk being bumped through; every other chunk hangs off its m_prev.
+    Chunk* m_chunk;
+    // The bump pointer and the end of the current chunk.
+    uintptr_t m_next;
+    uintptr_t m_end;
+
+    /**
+     * Maps a new chunk for an alloc() that didn't fit in the current one.
+     * Requests bigger than a quarter of a chunk get a chunk to themselves, which
+     * is tucked in behind the current one so its free space isn't wasted.
+     */
+    void* allocSlow(size_t bytes, size_t align) {
+        size_t needed;
+        if(__builtin_add_overflow(bytes, align - 1, &needed))
+            return nullptr;
+        if(needed > chunkSize / 4 && m_chunk != nullptr) {
+            Chunk* chunk = Chunk::create(needed, m_chunk->prev());
+            if(chunk == nullptr)
+                return nullptr;
+            m_chunk->setPrev(chunk);
+            return reinterpret_cast<void*>(alignUp(reinterpret_cast<uintptr_t>(chunk->begin()), align));
+        }
+
+        Chunk* chunk = Chunk::create(needed > chunkSize ? needed : chunkSize, m_chunk);
+        if(chunk == nullptr)
+            return nullptr;
+        m_chunk = chunk;
+        uintptr_t result = alignUp(reinterpret_cast<uintptr_t>(chunk->begin()), align);
+        m_next = result + bytes;
+        m_end = reinterpret_cast<uintptr_t>(chunk->end());
+        return reinterpret_cast<void*>(result);
+    }
+
+    static uintptr_t alignUp(uintptr_t address, size_t align) {
+        return (address + align - 1) & ~static_cast<uintptr_t>(align - 1);
+    }
+
+public:
+    /**
+     * The bytes of items per chunk. Chunks this size are medium allocations, so
+     * they're recycled through the PageReserve rather than mapped every time.
+     */
+    static constexpr size_t chunkSize = 16 * pageSize - sizeof(Chunk);
+
+    Region() : m_chunk(nullptr), m_next(0), m_end(0) {
+    }
+
+    Region(const Region& other) = delete;
+    Region& operator=(const Region& other) = delete;
+
+    ~Region() {
+        release();
+    }
+
+    /**
+     * Allocates `bytes` bytes aligned to `align`, which must be a power of two.
+     * Returns null if we're out of memory.
+     */
+    void* alloc(size_t bytes, size_t align = alignof(max_align_t)) {
+        uintptr_t result = alignUp(m_next, align);
+        // Compared this way round so huge requests can't wrap past m_end.
+        if(m_next == 0 || result < m_next || result > m_end || bytes > size_t(m_end - result)) {
+            return allocSlow(bytes, align);
+        }
+        m_next = result + bytes;
+        return reinterpret_cast<void*>(result);
+    }
+
+    /**
+     * Frees everything allocated so far. The current chunk is kept and bumped
+     * through again from the start.
+     */
+    void reset() {
+        if(m_chunk == nullptr) {
+            return;
+        }
+        Chunk* chunk = m_chunk->prev();
+        while(chunk != nullptr) {
+            chunk = chunk->release();
+        }
+        m_chunk->setPrev(nullptr);
+        m_next = reinterpret_cast<uintptr_t>(m_chunk->begin());
+    }
+
+    /**
+     * Frees everything allocated so far and unmaps every chunk.
+     */
+    void release() {
+        Chunk* chunk = m_chunk;
+        while(chunk != nullptr) {
+            chunk = chunk->release();
+        }
+        m_chunk = nullptr;
+        m_next = 0;
+        m_end = 0;
+    }
+};
+
+/**
+ * Lets standard containers allocate from a Region, e.g. through a
+ * std::pmr::vector. Deallocation does nothing; memory comes back when the
+ * Region is reset.
+ */
+class RegionResource : public std::pmr::memory_resource {
+    Region& m_region;
+
+public:
+    explicit RegionResource(Region& region) : m_region(region) {
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override {
+        void* result = m_region.alloc(bytes, align);
+        if(result == nullptr) {
+            throw std::bad_alloc();
+        }
+        return result;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Records every myMalloc() and myFree() (and the calls built on them) into a
+ * trace file, for replaying production workloads in the benchmarks.
+ *
+ * The file is a header followed by a ring of fixed size events, mapped shared
+ * so events land in the page cache without any write() calls. Each event takes
+ * its slot with one fetch_add on the header's counter, so the ring holds the
+ * last `capacity` events in the order they happened. Once it wraps, the oldest
+ * are overwritten.
+ *
+ * Objects are identified by their address, which is unique among live objects.
+ * Tracing costs a relaxed load and a predictable branch per call while off.
+ */
+class Trace {
+public:
+    enum Op : uint8_t {
+        // Written last, so a slot whose event isn't finished reads as None.
+        None = 0,
+        Malloc = 1,
+        Free = 2,
+        // A realloc() is a pair of events in adjacent slots: the object it
+        // resized, then the object it returned with its new size.
+        ReallocFrom = 3,
+        ReallocTo = 4,
+    };
+
+    struct Event {
+        uint64_t object;
+        // The size asked for, up to 4 GiB. Zero for frees.
+        uint32_t size;
+        // The tracing thread's number, from 1 in the order they first traced.
+        uint16_t thread;
+        uint8_t op;
+        uint8_t reserved;
+    };
+
+    struct Header {
+        char magic[8];
+        uint64_t capacity;
+        // Events recorded so far, wrapped or not.
+        std::atomic<uint64_t> next;
+        char reserved[4096 - 24];
+    };
+
+    static constexpr char magic[8] = {'M', 'Y', 'M', 'T', 'R', 'C', '0', '1'};
+
+    /**
+     * Starts tracing into the file at `path`, truncating it to hold `events`
+     * events (at least two). Returns false if the file can't be made, or we're
+     * already tracing.
+     */
+    static bool start(const char* path, size_t events);
+
+    /**
+     * Stops tracing. The file stays mapped, since other threads might still be
+     * writing their last events into it; it's synced and left for the OS to
+     * flush.
+     */
+    static void stop();
+
+    static bool enabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    static void record(Op op, void* object, size_t size);
+
+    static void recordRealloc(void* from, void* to, size_t size);
+
+    /**
+     * A trace file mapped for reading.
+     */
+    class Reader {
+        void* m_map;
+        size_t m_mapSize;
+        const Event* m_events;
+        uint64_t m_capacity;
+        uint64_t m_next;
+
+    public:
+        Reader();
+        ~Reader();
+        Reader(const Reader& other) = delete;
+        Reader& operator=(const Reader& other) = delete;
+
+        /**
+         * Maps the trace at `path`. Returns false if it isn't one.
+         */
+        bool open(const char* path);
+
+        /**
+         * The number of events still in the ring.
+         */
+        size_t count() const {
+            return m_next < m_capacity ? m_next : m_capacity;
+        }
+
+        /**
+         * The i'th oldest event still in the ring.
+         */
+        const Event& operator[](size_t i) const {
+            return m_events[(m_next - count() + i) % m_capacity];
+        }
+
+        /**
+         * Whether the ring wrapped, so older events were lost.
+         */
+        bool wrapped() const {
+            return m_next > m_capacity;
+        }
+    };
+
+private:
+    static std::atomic<bool> s_enabled;
+};
@@ -0,0 +1,248 @@
+#include <Malloc.hpp>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+
+// Interposes the C allocation functions and the global operator new/delete
+// with the allocator, so it can be dropped into an existing program with
+//
+//     LD_PRELOAD=./libmymalloc.so program
+//
+// These can run before the program's static constructors, and in threads
+// whose TLS hasn't been touched yet, so nothing here may depend on either:
+// all of the allocator's globals are constant initialized, and the thread's
+// store pointer is initial-exec TLS (see the Makefile) that can't allocate.
+//
+// The library is built with hidden visibility, so only what's marked here is
+// exported and calls inside the allocator don't go through the PLT.
+#define MALLOC_EXPORT __attribute__((visibility("default")))
+
+/**
+ * Whether ptr was handed out by the allocator. The dynamic loader allocates
+ * from its own bootstrap heap before we're relocated, and may later free or
+ * resize that memory through us.
+ */
+static bool owned(void* ptr) {
+    return PageMap::lookup(ptr) != nullptr;
+}
+
+/**
+ * MYMALLOC_TRACE=file records a trace of the program's allocations into
+ * file.<pid> for the benchmarks to replay, keeping the last
+ * MYMALLOC_TRACE_EVENTS of them (16M, a 256 MiB file, by default). The pid
+ * keeps child processes, which inherit the variable, from truncating their
+ * parent's trace.
+ */
+__attribute__((constructor)) static void startTrace() {
+    const char* path = getenv("MYMALLOC_TRACE");
+    if(path == nullptr || path[0] == '\0') {
+        return;
+    }
+    char file[4096];
+    if(snprintf(file, sizeof(file), "%s.%d", path, static_cast<int>(getpid())) >= static_cast<int>(sizeof(file))) {
+        return;
+    }
+    const char* events = getenv("MYMALLOC_TRACE_EVENTS");
+    size_t count = events != nullptr ? strtoul(events, nullptr, 10) : 0;
+    myMallocTraceStart(file, count > 0 ? count : size_t(16) << 20);
+}
+
+/**
+ * MYMALLOC_BACKGROUND_PURGE=1 starts the background purger (see
+ * myMallocBackgroundPurge()).
+ */
+__attribute__((constructor)) static void startPurger() {
+    const char* purge = getenv("MYMALLOC_BACKGROUND_PURGE");
+    if(purge != nullptr && strcmp(purge, "1") == 0) {
+        myMallocBackgroundPurge(true);
+    }
+}
+
+/**
+ * Keeps the allocator's locks consistent across fork(), so a child forked from
+ * a multithreaded program can allocate (see myMallocPrepareFork()).
+ */
+__attribute__((constructor)) static void handleForks() {
+    pthread_atfork(myMallocPrepareFork, myMallocParentAfterFork, myMallocChildAfterFork);
+}
+
+static_assert(sizeof(Arena) % alignof(max_align_t) == 0, "Arena slots can't be aligned for malloc()");
+
+/**
+ * malloc() promises memory aligned for any type that fits, which is more than
+ * myMalloc() does for the classes that aren't a multiple of 16 bytes.
+ */
+static void* mallocImpl(size_t n) {
+    return n <= 8 ? myMalloc(n) : myMallocMaxAligned(n);
+}
+
+extern "C" {
+
+MALLOC_EXPORT void* malloc(size_t n) noexcept {
+    return mallocImpl(n);
+}
+
+MALLOC_EXPORT void free(void* ptr) noexcept {
+    if(ptr != nullptr && owned(ptr)) {
+        myFree(ptr);
+    }
+}
+
+MALLOC_EXPORT void* calloc(size_t count, size_t n) noexcept {
+    size_t bytes;
+    if(__builtin_mul_overflow(count, n, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    // Aligned like mallocImpl(), and memory that was never used isn't cleared.
+    return bytes <= 8 ? myCalloc(count, n) : myCallocMaxAligned(count, n);
+}
+
+MALLOC_EXPORT void* realloc(void* ptr, size_t n) noexcept {
+    if(ptr != nullptr && !owned(ptr)) {
+        // We can't know how much of a foreign block to copy.
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return myRealloc(ptr, n);
+}
+
+MALLOC_EXPORT void* memalign(size_t alignment, size_t n) noexcept {
+    return myAlignedAlloc(alignment, n);
+}
+
+MALLOC_EXPORT void* aligned_alloc(size_t alignment, size_t n) noexcept {
+    return myAlignedAlloc(alignment, n);
+}
+
+MALLOC_EXPORT int posix_memalign(void** out, size_t alignment, size_t n) noexcept {
+    return myPosixMemalign(out, alignment, n);
+}
+
+MALLOC_EXPORT void* valloc(size_t n) noexcept {
+    return myAlignedAlloc(pageSize, n);
+}
+
+MALLOC_EXPORT size_t malloc_usable_size(void* ptr) noexcept {
+    return ptr != nullptr && owned(ptr) ? myMallocUsableSize(ptr) : 0;
+}
+
+MALLOC_EXPORT int malloc_trim(size_t) noexcept {
+    return myMallocTrim() > 0;
+}
+
+}
+
+/**
+ * operator new has to call the new handler until it either frees up enough
+ * memory or throws, and throw std::bad_alloc if there isn't one.
+ */
+static void* newImpl(size_t n, size_t alignment) {
+    for(;;) {
+        void* result = alignment > alignof(max_align_t) ? myAlignedAlloc(alignment, n) : mallocImpl(n);
+        if(result != nullptr) {
+            return result;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if(handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* newNothrow(size_t n, size_t alignment) noexcept {
+    try {
+        return newImpl(n, alignment);
+    }
+    catch(...) {
+        return nullptr;
+    }
+}
+
+MALLOC_EXPORT void* operator new(size_t n) {
+    return newImpl(n, 0);
+}
+
+MALLOC_EXPORT void* operator new[](size_t n) {
+    return newImpl(n, 0);
+}
+
+MALLOC_EXPORT void* operator new(size_t n, const std::nothrow_t&) noexcept {
+    return newNothrow(n, 0);
+}
+
+MALLOC_EXPORT void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+    return newNothrow(n, 0);
+}
+
+MALLOC_EXPORT void* operator new(size_t n, std::align_val_t alignment) {
+    return newImpl(n, static_cast<size_t>(alignment));
+}
+
+MALLOC_EXPORT void* operator new[](size_t n, std::align_val_t alignment) {
+    return newImpl(n, static_cast<size_t>(alignment));
+}
+
+MALLOC_EXPORT void* operator new(size_t n, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return newNothrow(n, static_cast<size_t>(alignment));
+}
+
+MALLOC_EXPORT void* operator new[](size_t n, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return newNothrow(n, static_cast<size_t>(alignment));
+}
+
+// Sized deletes go straight to myFreeSized(). Everything new hands out is ours,
+// so they don't need the ownership check free() does.
+
+MALLOC_EXPORT void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete(void* ptr, size_t n) noexcept {
+    myFreeSized(ptr, n);
+}
+
+MALLOC_EXPORT void operator delete[](void* ptr, size_t n) noexcept {
+    myFreeSized(ptr, n);
+}
+
+MALLOC_EXPORT void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+MALLOC_EXPORT void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
@@ -0,0 +1,249 @@
+#include <HeapProfiler.hpp>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+
+// The side table is open addressed with linear probing, and kept at most three
+// quarters full.
+static constexpr size_t tableBits = 14;
+static constexpr size_t tableSize = size_t(1) << tableBits;
+static_assert(HeapProfiler::maxSamples <= tableSize * 3 / 4, "The sample table would fill up");
+
+struct Sample {
+    // The sampled item, or null for an unused slot.
+    void* ptr;
+    // The size it was allocated with, and the bytes of live data it stands for.
+    size_t bytes;
+    size_t weight;
+    // Call sites from the innermost out.
+    size_t depth;
+    void* stack[HeapProfiler::maxDepth];
+};
+
+static std::mutex s_lock;
+static Sample s_table[tableSize];
+static std::atomic<size_t> s_samples;
+
+static std::atomic<size_t> s_sampleBytes = MALLOC_SAMPLE_BYTES;
+
+// Set while this thread is recording or dumping, so allocations made meanwhile
+// (say by backtrace() loading libgcc the first time) aren't sampled.
+static thread_local bool t_busy;
+
+static size_t slotFor(void* ptr) {
+    return (reinterpret_cast<uintptr_t>(ptr) * 0x9e3779b97f4a7c15ULL) >> (64 - tableBits);
+}
+
+/**
+ * The slot holding `ptr`, or the empty one where it would go. Call with the
+ * lock held.
+ */
+static size_t find(void* ptr) {
+    size_t slot = slotFor(ptr);
+    while(s_table[slot].ptr != nullptr && s_table[slot].ptr != ptr) {
+        slot = (slot + 1) % tableSize;
+    }
+    return slot;
+}
+
+/**
+ * Empties a slot and moves later entries of its probe run back into the gap,
+ * so lookups never need tombstones.
+ */
+static void erase(size_t slot) {
+    size_t next = slot;
+    for(;;) {
+        next = (next + 1) % tableSize;
+        if(s_table[next].ptr == nullptr) {
+            break;
+        }
+        // The entry can move into the gap unless its home lies cyclically
+        // between the gap and where it sits now.
+        size_t home = slotFor(s_table[next].ptr);
+        if((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+            s_table[slot] = s_table[next];
+            slot = next;
+        }
+    }
+    s_table[slot].ptr = nullptr;
+}
+
+size_t HeapProfiler::sampleBytes() {
+    return s_sampleBytes.load(std::memory_order_relaxed);
+}
+
+void HeapProfiler::setSampleBytes(size_t bytes) {
+    s_sampleBytes.store(bytes, std::memory_order_relaxed);
+}
+
+int64_t HeapProfiler::nextSample(uint64_t& state) {
+    size_t rate = sampleBytes();
+    if(rate == 0) {
+        return INT64_MAX;
+    }
+    // xorshift64, then the top 53 bits as a uniform value in (0, 1].
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    double uniform = static_cast<double>((state >> 11) + 1) / static_cast<double>(uint64_t(1) << 53);
+    double bytes = -log(uniform) * static_cast<double>(rate);
+    return bytes < static_cast<double>(INT64_MAX / 2) ? static_cast<int64_t>(bytes) + 1 : INT64_MAX / 2;
+}
+
+bool HeapProfiler::record(void* ptr, size_t bytes) {
+    if(t_busy || s_samples.load(std::memory_order_relaxed) >= maxSamples) {
+        return false;
+    }
+    t_busy = true;
+
+    // The first frame is our own.
+    void* frames[maxDepth + 1];
+    int depth = backtrace(frames, maxDepth + 1);
+    depth = depth > 1 ? depth - 1 : 0;
+
+    double rate = static_cast<double>(sampleBytes());
+    double probability = rate > 0 ? 1 - exp(-static_cast<double>(bytes) / rate) : 1;
+
+    bool recorded = false;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        if(s_samples.load(std::memory_order_relaxed) < maxSamples) {
+            Sample& sample = s_table[find(ptr)];
+            sample.ptr = ptr;
+            sample.bytes = bytes;
+            sample.weight = probability > 0 ? static_cast<size_t>(static_cast<double>(bytes) / probability) : bytes;
+            sample.depth = depth;
+            memcpy(sample.stack, frames + 1, depth * sizeof(void*));
+            s_samples.fetch_add(1, std::memory_order_relaxed);
+            recorded = true;
+        }
+    }
+    t_busy = false;
+    return recorded;
+}
+
+bool HeapProfiler::forget(void* ptr, size_t& bytes) {
+    if(s_samples.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(s_lock);
+    size_t slot = find(ptr);
+    if(s_table[slot].ptr == nullptr) {
+        return false;
+    }
+    bytes = s_table[slot].bytes;
+    erase(slot);
+    s_samples.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool HeapProfiler::sampled(void* ptr) {
+    if(s_samples.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(s_lock);
+    return s_table[find(ptr)].ptr != nullptr;
+}
+
+size_t HeapProfiler::samples() {
+    return s_samples.load(std::memory_order_relaxed);
+}
+
+void HeapProfiler::lockForFork() {
+    s_lock.lock();
+}
+
+void HeapProfiler::unlockAfterFork() {
+    s_lock.unlock();
+}
+
+/**
+ * Buffers the dump so it's written a few kilobytes at a time.
+ */
+struct DumpWriter {
+    int fd;
+    size_t length = 0;
+    char buffer[4096];
+
+    void flush() {
+        size_t done = 0;
+        while(done < length) {
+            ssize_t written = write(fd, buffer + done, length - done);
+            if(written <= 0) {
+                break;
+            }
+            done += written;
+        }
+        length = 0;
+    }
+
+    void frame(void* address, bool first) {
+        // Frames are cut to this long, so one always fits after a flush.
+        constexpr size_t maxFrame = 512;
+        if(length + maxFrame > sizeof(buffer)) {
+            flush();
+        }
+        char* out = buffer + length;
+        const char* separator = first ? "" : ";";
+        // Return addresses point after the call, so look up the call itself.
+        uintptr_t site = reinterpret_cast<uintptr_t>(address) - 1;
+        Dl_info info = {};
+        int n;
+        if(dladdr(reinterpret_cast<void*>(site), &info) != 0 && info.dli_sname != nullptr) {
+            n = snprintf(out, maxFrame, "%s%s", separator, info.dli_sname);
+        }
+        else if(info.dli_fname != nullptr && info.dli_fbase != nullptr) {
+            const char* module = strrchr(info.dli_fname, '/');
+            n = snprintf(out, maxFrame, "%s%s+0x%lx", separator, module != nullptr ? module + 1 : info.dli_fname,
+                site - reinterpret_cast<uintptr_t>(info.dli_fbase));
+        }
+        else {
+            n = snprintf(out, maxFrame, "%s0x%lx", separator, site);
+        }
+        if(n > 0) {
+            length += static_cast<size_t>(n) < maxFrame ? n : maxFrame - 1;
+        }
+    }
+
+    void weight(size_t bytes) {
+        if(length + 32 > sizeof(buffer)) {
+            flush();
+        }
+        length += snprintf(buffer + length, sizeof(buffer) - length, " %zu\n", bytes);
+    }
+};
+
+size_t HeapProfiler::dump(int fd) {
+    bool busy = t_busy;
+    t_busy = true;
+    // The first backtrace() loads libgcc, under the dynamic linker's lock that
+    // dladdr() takes too. If some thread is doing that now, let it finish before
+    // we hold our lock, since it may free a sample while loading.
+    void* caller;
+    backtrace(&caller, 1);
+
+    DumpWriter writer;
+    writer.fd = fd;
+    size_t written = 0;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        for(const Sample& sample : s_table) {
+            if(sample.ptr == nullptr) {
+                continue;
+            }
+            for(size_t i = sample.depth; i > 0; i--) {
+                writer.frame(sample.stack[i - 1], i == sample.depth);
+            }
+            writer.weight(sample.weight);
+            written++;
+        }
+    }
+    writer.flush();
+    t_busy = busy;
+    return written;
+}
@@ -1,15 +1,814 @@
 #include <iostream>
 #include <sstream>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #include <Malloc.hpp>
+#include <Trace.hpp>
+
+// The benchmarks. `make bench` builds this with optimization and runs every
+// scenario against both myMalloc() and the C library's malloc(), which this
+// binary isn't interposed on, as a baseline. Every scenario uses fixed seeds,
+// so runs are repeatable. `replay <file>` plays back a trace recorded with
+// myMallocTraceStart() (or MYMALLOC_TRACE under the preload library) instead.
 
 void usage() {
-    std::cerr << "Usage: factorial <N>" << std::endl;
+    std::cerr << "Usage: example [-t threads] [-r repetitions] [-s scale] [scenario...]" << std::endl;
+    std::cerr << "       example [-r repetitions] replay <trace>" << std::endl;
+    std::cerr << "Scenarios: fixed random prodcons larson threadtest realloc (default: all)" << std::endl;
     exit(1);
 }
 
+/**
+ * The allocator a scenario runs against.
+ */
+struct Allocator {
+    const char* name;
+    void* (*alloc)(size_t);
+    void (*free)(void*);
+    void* (*realloc)(void*, size_t);
+    // Gives back whatever the allocator is caching, between scenarios.
+    void (*trim)();
+    // Whether myMallocStats() counts its system calls.
+    bool counted;
+};
+
+static void trimMyMalloc() {
+    myMallocTrim();
+}
+
+static void trimLibc() {
+    malloc_trim(0);
+}
+
+static const Allocator allocators[] = {
+    {MallocPolicy::hardened ? "hardened" : MallocPolicy::name, myMalloc, myFree, myRealloc, trimMyMalloc, true},
+    {"glibc", malloc, free, realloc, trimLibc, false},
+};
+
+/**
+ * xorshift64, so every run draws the same numbers on every platform.
+ */
+struct Random {
+    uint64_t state;
+
+    explicit Random(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15ULL + 1) {
+    }
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    size_t below(size_t n) {
+        return next() % n;
+    }
+};
+
+/**
+ * The size mix of getRandomSize() in the tests: mostly small, with one request
+ * in five between 1k and 10k.
+ */
+static size_t randomSize(Random& random) {
+    switch(random.below(10)) {
+        case 0: return random.below(8) + 1;
+        case 1: return random.below(16) + 1;
+        case 2: return random.below(32) + 1;
+        case 4: return random.below(64) + 1;
+        case 5: return random.below(128) + 1;
+        case 6: return random.below(256) + 1;
+        case 7: return random.below(512) + 1;
+        case 8: return random.below(1024) + 1;
+        default: return random.below(10'000 - 1024) + 1024;
+    }
+}
+
+/**
+ * What the scenarios are given to run with.
+ */
+struct Options {
+    size_t threads;
+    size_t scale;
+    // For the fixed-size scenario, the request size.
+    size_t size;
+};
+
+// Each scenario returns the number of allocator calls it made, and sets
+// `peakBytes` to the most bytes it had asked for and not yet freed at once, so
+// its RSS can be set against them. Threaded ones add up each thread's peak.
+typedef size_t (*Scenario)(const Allocator&, const Options&, size_t& peakBytes);
+
+/**
+ * Allocates and frees a batch of same-sized items over and over.
+ */
+static size_t fixedSize(const Allocator& allocator, const Options& options, size_t& peakBytes) {
+    constexpr size_t batch = 1024;
+    void* ptrs[batch];
+    size_t rounds = 200 * options.scale;
+    peakBytes = batch * options.size;
+    for(size_t round = 0; round < rounds; round++) {
+        for(size_t i = 0; i < batch; i++) {
+            ptrs[i] = allocator.alloc(options.size);
+            *static_cast<volatile char*>(ptrs[i]) = 1;
+        }
+        for(size_t i = 0; i < batch; i++) {
+            allocator.free(ptrs[i]);
+        }
+    }
+    return rounds * batch * 2;
+}
+
+/**
+ * The random walk from the tests: a working set of up to a thousand items of
+ * randomSize(), with random ones freed and replaced.
+ */
+static size_t randomWalk(const Allocator& allocator, const Options& options, size_t& peakBytes) {
+    constexpr size_t live = 1000;
+    void* ptrs[live] = {};
+    size_t sizes[live] = {};
+    Random random(1);
+    size_t steps = 200'000 * options.scale;
+    size_t ops = 0;
+    size_t liveBytes = 0;
+    peakBytes = 0;
+    for(size_t step = 0; step < steps; step++) {
+        size_t i = random.below(live);
+        if(ptrs[i] != nullptr) {
+            allocator.free(ptrs[i]);
+            liveBytes -= sizes[i];
+            ops++;
+        }
+        size_t size = randomSize(random);
+        ptrs[i] = allocator.alloc(size);
+        static_cast<volatile char*>(ptrs[i])[size - 1] = 1;
+        sizes[i] = size;
+        liveBytes += size;
+        peakBytes = std::max(peakBytes, liveBytes);
+        ops++;
+    }
+    for(void* ptr : ptrs) {
+        if(ptr != nullptr) {
+            allocator.free(ptr);
+            ops++;
+        }
+    }
+    return ops;
+}
+
+/**
+ * Pairs of threads where one allocates and hands each item to the other to
+ * free, through a single producer single consumer ring, so every free is a
+ * cross-thread one.
+ */
+static size_t producerConsumer(const Allocator& allocator, const Options& options, size_t& peakBytes) {
+    constexpr size_t ringSize = 1024;
+    struct alignas(cacheLineSize) Ring {
+        void* slots[ringSize];
+        uint32_t sizes[ringSize];
+        alignas(cacheLineSize) std::atomic<size_t> head{0};
+        alignas(cacheLineSize) std::atomic<size_t> tail{0};
+        // The bytes the consumer has freed, next to the tail the producer
+        // reads anyway, so the producer can tell how much is live.
+        std::atomic<size_t> freed{0};
+        size_t peak = 0;
+    };
+
+    size_t pairs = std::max<size_t>(options.threads / 2, 1);
+    size_t items = 100'000 * options.scale;
+    std::vector<Ring> rings(pairs);
+    std::vector<std::thread> threads;
+    for(size_t p = 0; p < pairs; p++) {
+        Ring& ring = rings[p];
+        threads.emplace_back([&allocator, &ring, items, p] {
+            Random random(p + 1);
+            size_t allocated = 0;
+            for(size_t i = 0; i < items; i++) {
+                size_t size = 64 + random.below(192);
+                void* ptr = allocator.alloc(size);
+                allocated += size;
+                ring.peak = std::max(ring.peak, allocated - ring.freed.load(std::memory_order_relaxed));
+                size_t head = ring.head.load(std::memory_order_relaxed);
+                while(head - ring.tail.load(std::memory_order_acquire) == ringSize) {
+                    std::this_thread::yield();
+                }
+                ring.slots[head % ringSize] = ptr;
+                ring.sizes[head % ringSize] = size;
+                ring.head.store(head + 1, std::memory_order_release);
+            }
+        });
+        threads.emplace_back([&allocator, &ring, items] {
+            size_t freed = 0;
+            for(size_t i = 0; i < items; i++) {
+                size_t tail = ring.tail.load(std::memory_order_relaxed);
+                while(ring.head.load(std::memory_order_acquire) == tail) {
+                    std::this_thread::yield();
+                }
+                allocator.free(ring.slots[tail % ringSize]);
+                freed += ring.sizes[tail % ringSize];
+                ring.freed.store(freed, std::memory_order_relaxed);
+                ring.tail.store(tail + 1, std::memory_order_release);
+            }
+        });
+    }
+    for(std::thread& thread : threads) {
+        thread.join();
+    }
+    peakBytes = 0;
+    for(const Ring& ring : rings) {
+        peakBytes += ring.peak;
+    }
+    return pairs * items * 2;
+}
+
+/**
+ * After Larson and Krishnan: each thread keeps an array of small items and
+ * replaces random ones. Then a new generation of threads takes over, each
+ * inheriting the previous thread's neighbour's array, so the old items are
+ * freed by a thread that didn't allocate them and the threads that did have
+ * exited.
+ */
+static size_t larson(const Allocator& allocator, const Options& options, size_t& peakBytes) {
+    constexpr size_t slots = 1000;
+    constexpr size_t generations = 4;
+    size_t replacements = 25'000 * options.scale;
+    struct Array {
+        std::vector<void*> ptrs = std::vector<void*>(slots);
+        std::vector<size_t> sizes = std::vector<size_t>(slots);
+        size_t bytes = 0;
+        size_t peak = 0;
+    };
+    std::vector<Array> arrays(options.threads);
+    for(size_t t = 0; t < options.threads; t++) {
+        Random random(t + 1);
+        Array& array = arrays[t];
+        for(size_t slot = 0; slot < slots; slot++) {
+            array.sizes[slot] = 16 + random.below(113);
+            array.ptrs[slot] = allocator.alloc(array.sizes[slot]);
+            array.bytes += array.sizes[slot];
+        }
+        array.peak = array.bytes;
+    }
+
+    for(size_t g = 0; g < generations; g++) {
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < options.threads; t++) {
+            Array& array = arrays[(t + g) % options.threads];
+            threads.emplace_back([&allocator, &array, replacements, t, g] {
+                Random random((g + 1) * 1000 + t);
+                for(size_t i = 0; i < replacements; i++) {
+                    size_t slot = random.below(slots);
+                    allocator.free(array.ptrs[slot]);
+                    array.bytes -= array.sizes[slot];
+                    array.sizes[slot] = 16 + random.below(113);
+                    array.ptrs[slot] = allocator.alloc(array.sizes[slot]);
+                    array.bytes += array.sizes[slot];
+                    array.peak = std::max(array.peak, array.bytes);
+                }
+            });
+        }
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    peakBytes = 0;
+    for(Array& array : arrays) {
+        for(void* ptr : array.ptrs) {
+            allocator.free(ptr);
+        }
+        peakBytes += array.peak;
+    }
+    return options.threads * (slots * 2 + generations * replacements * 2);
+}
+
+/**
+ * After Hoard's threadtest: every thread repeatedly allocates a batch of
+ * small items and then frees them all.
+ */
+static size_t threadtest(const Allocator& allocator, const Options& options, size_t& peakBytes) {
+    constexpr size_t batch = 2000;
+    size_t iterations = 100 * options.scale;
+    peakBytes = options.threads * batch * 64;
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < options.threads; t++) {
+        threads.emplace_back([&allocator, iterations] {
+            std::vector<void*> ptrs(batch);
+            for(size_t i = 0; i < iterations; i++) {
+                for(void*& ptr : ptrs) {
+                    ptr = allocator.alloc(64);
+                    *static_cast<volatile char*>(ptr) = 1;
+                }
+                for(void* ptr : ptrs) {
+                    allocator.free(ptr);
+                }
+            }
+        });
+    }
+    for(std::thread& thread : threads) {
+        thread.join();
+    }
+    return options.threads * iterations * batch * 2;
+}
+
+/**
+ * Grows buffers a little at a time, the way appending to a string does, from
+ * 16 bytes up to 64k.
+ */
+static size_t reallocGrowth(const Allocator& allocator, const Options& options, size_t& peakBytes) {
+    constexpr size_t limit = 64 * 1024;
+    size_t chains = 50 * options.scale;
+    size_t ops = 0;
+    peakBytes = 0;
+    for(size_t chain = 0; chain < chains; chain++) {
+        size_t size = 16;
+        char* ptr = static_cast<char*>(allocator.alloc(size));
+        while(size < limit) {
+            size += 64;
+            ptr = static_cast<char*>(allocator.realloc(ptr, size));
+            ptr[size - 1] = 1;
+            ops++;
+        }
+        peakBytes = std::max(peakBytes, size);
+        allocator.free(ptr);
+        ops += 2;
+    }
+    return ops;
+}
+
+/**
+ * A field of /proc/self/status, in kilobytes, or zero.
+ */
+static size_t statusKilobytes(const char* field);
+
+/**
+ * A trace turned into something that replays at full speed: each traced
+ * thread's calls in order, with the objects numbered densely so replaying
+ * needs no lookups.
+ */
+struct Replay {
+    enum Op : uint8_t { Malloc, Free, Realloc };
+
+    struct Call {
+        // The call's position in the whole trace.
+        uint64_t seq;
+        // The object allocated (for Malloc and Realloc) or freed.
+        uint32_t object;
+        // For Realloc, the object resized.
+        uint32_t from;
+        uint32_t size;
+        Op op;
+    };
+
+    std::vector<std::vector<Call>> threads;
+    size_t objects = 0;
+    size_t calls = 0;
+    // The objects still live at the end of the trace.
+    std::vector<uint32_t> leftovers;
+
+    // Live bytes asked for at every twentieth of the way through.
+    static constexpr size_t checkpoints = 20;
+    uint64_t seqAt[checkpoints];
+    uint64_t liveAt[checkpoints];
+    // The most live bytes asked for at any point.
+    uint64_t peakLive = 0;
+
+    // For each object, where it's allocated at replay time. Frees of objects
+    // allocated by another thread wait for them to show up here.
+    std::unique_ptr<std::atomic<void*>[]> pointers;
+
+    // How far through the fragmentation timeline the last run got, and what it
+    // saw: time, live bytes asked for and RSS growth at each checkpoint.
+    size_t reached = 0;
+    double timeAt[checkpoints];
+    size_t rssAt[checkpoints];
+
+    /**
+     * Builds the replay from a trace. Frees of objects allocated before the
+     * ring's oldest event are dropped, and reallocs of them become mallocs.
+     */
+    bool load(const char* path) {
+        Trace::Reader trace;
+        if(!trace.open(path)) {
+            return false;
+        }
+        std::unordered_map<uint64_t, uint32_t> live;
+        std::unordered_map<uint16_t, size_t> threadIndex;
+        std::vector<uint32_t> sizes;
+        uint64_t liveBytes = 0;
+        size_t count = trace.count();
+        size_t checkpoint = 0;
+
+        for(size_t i = 0; i < count; i++) {
+            const Trace::Event& event = trace[i];
+            if(event.op == Trace::None) {
+                continue;
+            }
+            auto found = threadIndex.find(event.thread);
+            if(found == threadIndex.end()) {
+                found = threadIndex.emplace(event.thread, threads.size()).first;
+                threads.emplace_back();
+            }
+            std::vector<Call>& calls = threads[found->second];
+
+            Call call = {i, 0, 0, event.size, Malloc};
+            if(event.op == Trace::Free || event.op == Trace::ReallocFrom) {
+                auto object = live.find(event.object);
+                bool resize = event.op == Trace::ReallocFrom;
+                const Trace::Event* to = resize && i + 1 < count ? &trace[i + 1] : nullptr;
+                if(resize) {
+                    i++;
+                    if(to == nullptr || to->op != Trace::ReallocTo) {
+                        continue;
+                    }
+                    call.size = to->size;
+                }
+                if(object != live.end()) {
+                    call.op = resize ? Realloc : Free;
+                    call.from = object->second;
+                    liveBytes -= sizes[object->second];
+                    live.erase(object);
+                }
+                else if(!resize) {
+                    continue;
+                }
+                if(resize) {
+                    call.object = sizes.size();
+                    live[to->object] = call.object;
+                    sizes.push_back(call.size);
+                    liveBytes += call.size;
+                }
+                else {
+                    call.object = call.from;
+                }
+            }
+            else if(event.op == Trace::Malloc) {
+                call.object = sizes.size();
+                live[event.object] = call.object;
+                sizes.push_back(event.size);
+                liveBytes += event.size;
+            }
+            else {
+                continue;
+            }
+            calls.push_back(call);
+            this->calls++;
+            peakLive = std::max(peakLive, liveBytes);
+
+            while(checkpoint < checkpoints && i + 1 >= count * (checkpoint + 1) / checkpoints) {
+                seqAt[checkpoint] = i;
+                liveAt[checkpoint] = liveBytes;
+                checkpoint++;
+            }
+        }
+        for(; checkpoint < checkpoints; checkpoint++) {
+            seqAt[checkpoint] = count;
+            liveAt[checkpoint] = liveBytes;
+        }
+        for(const auto& object : live) {
+            leftovers.push_back(object.second);
+        }
+        objects = sizes.size();
+        pointers.reset(new std::atomic<void*>[objects]);
+        return true;
+    }
+
+    /**
+     * Replays every thread's calls at once against `allocator`, each thread on
+     * its own. Returns the number of calls made.
+     */
+    size_t run(const Allocator& allocator) {
+        for(size_t i = 0; i < objects; i++) {
+            pointers[i].store(nullptr, std::memory_order_relaxed);
+        }
+        struct alignas(cacheLineSize) Progress {
+            // The seq of the thread's next call, or ~0 once it's done.
+            std::atomic<uint64_t> next;
+        };
+        std::vector<Progress> progress(threads.size());
+        for(size_t t = 0; t < threads.size(); t++) {
+            progress[t].next.store(threads[t].empty() ? ~uint64_t(0) : threads[t][0].seq);
+        }
+
+        size_t rssBefore = statusKilobytes("VmRSS:");
+        auto start = std::chrono::steady_clock::now();
+        std::atomic<bool> go(false);
+        std::vector<std::thread> workers;
+        for(size_t t = 0; t < threads.size(); t++) {
+            workers.emplace_back([this, &allocator, &go, &progress, t] {
+                while(!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                const std::vector<Call>& calls = threads[t];
+                for(size_t i = 0; i < calls.size(); i++) {
+                    const Call& call = calls[i];
+                    void* old = nullptr;
+                    if(call.op != Malloc) {
+                        // Every wait is for an earlier call, so this can't deadlock.
+                        while((old = pointers[call.from].load(std::memory_order_acquire)) == nullptr) {
+                            std::this_thread::yield();
+                        }
+                    }
+                    if(call.op == Free) {
+                        allocator.free(old);
+                    }
+                    else {
+                        void* ptr = call.op == Malloc ? allocator.alloc(call.size) : allocator.realloc(old, call.size);
+                        if(ptr == nullptr) {
+                            abort();
+                        }
+                        // Touch every page, as the program would have, so the
+                        // RSS is comparable to the bytes it had live.
+                        for(size_t offset = 0; offset < call.size; offset += pageSize) {
+                            static_cast<volatile char*>(ptr)[offset] = 1;
+                        }
+                        pointers[call.object].store(ptr, std::memory_order_release);
+                    }
+                    progress[t].next.store(i + 1 < calls.size() ? calls[i + 1].seq : ~uint64_t(0),
+                        std::memory_order_release);
+                }
+            });
+        }
+        go.store(true, std::memory_order_release);
+
+        // Every call before the slowest thread's next one has been made, so
+        // that's how far the fragmentation timeline has got.
+        reached = 0;
+        while(reached < checkpoints) {
+            uint64_t done = ~uint64_t(0);
+            for(Progress& p : progress) {
+                done = std::min(done, p.next.load(std::memory_order_acquire));
+            }
+            while(reached < checkpoints && done > seqAt[reached]) {
+                size_t rss = statusKilobytes("VmRSS:");
+                timeAt[reached] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                rssAt[reached] = rss > rssBefore ? rss - rssBefore : 0;
+                reached++;
+            }
+            if(done == ~uint64_t(0)) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for(std::thread& worker : workers) {
+            worker.join();
+        }
+
+        // Free whatever the trace left live, so runs start from the same place.
+        for(uint32_t object : leftovers) {
+            allocator.free(pointers[object].load(std::memory_order_relaxed));
+        }
+        return calls + leftovers.size();
+    }
+};
+
+/**
+ * A field of /proc/self/status, in kilobytes, or zero.
+ */
+static size_t statusKilobytes(const char* field) {
+    int fd = open("/proc/self/status", O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    char buffer[4096];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if(length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    const char* line = strstr(buffer, field);
+    return line != nullptr ? strtoul(line + strlen(field), nullptr, 10) : 0;
+}
+
+/**
+ * Resets the peak resident set size the kernel reports as VmHWM to the current
+ * one, so each run's peak can be measured.
+ */
+static bool resetPeakRss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if(fd < 0) {
+        return false;
+    }
+    bool reset = write(fd, "5", 1) == 1;
+    close(fd);
+    return reset;
+}
+
+/**
+ * What one run of a scenario measured.
+ */
+struct Measurement {
+    double seconds;
+    size_t ops;
+    // How far the peak RSS rose above the RSS at the start, in kilobytes.
+    size_t peakRss;
+    // The most the scenario had asked for and not freed, in kilobytes.
+    size_t peakLive;
+    size_t syscalls;
+    size_t faults;
+};
+
+static size_t countedSyscalls() {
+    MallocStats stats = myMallocStats();
+    return stats.mmapCalls + stats.munmapCalls + stats.reserveSyscalls;
+}
+
+static Measurement measure(Scenario scenario, const Allocator& allocator, const Options& options) {
+    allocator.trim();
+    bool peakReset = resetPeakRss();
+    size_t rssBefore = statusKilobytes("VmRSS:");
+    size_t syscallsBefore = countedSyscalls();
+    rusage usageBefore;
+    getrusage(RUSAGE_SELF, &usageBefore);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t peakBytes = 0;
+    size_t ops = scenario(allocator, options, peakBytes);
+    auto end = std::chrono::steady_clock::now();
+
+    rusage usageAfter;
+    getrusage(RUSAGE_SELF, &usageAfter);
+    size_t peak = peakReset ? statusKilobytes("VmHWM:") : statusKilobytes("VmRSS:");
+
+    Measurement result;
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.ops = ops;
+    result.peakRss = peak > rssBefore ? peak - rssBefore : 0;
+    result.peakLive = peakBytes / 1024;
+    result.syscalls = countedSyscalls() - syscallsBefore;
+    result.faults = usageAfter.ru_minflt - usageBefore.ru_minflt;
+    return result;
+}
+
+/**
+ * Prints the column headings for report().
+ */
+static void printHeader() {
+    printf("%-14s %-9s %7s %10s %8s %9s %11s %9s %8s %9s %9s\n", "scenario", "allocator", "threads", "ops", "ns/op",
+        "Mops/s", "peak RSS KB", "live KB", "RSS/live", "syscalls", "faults");
+}
+
+/**
+ * Runs a scenario `repetitions` times and prints the median run.
+ */
+static void report(const char* name, Scenario scenario, const Allocator& allocator, const Options& options,
+        size_t threads, size_t repetitions) {
+    std::vector<Measurement> runs;
+    for(size_t i = 0; i < repetitions; i++) {
+        runs.push_back(measure(scenario, allocator, options));
+    }
+    std::sort(runs.begin(), runs.end(), [](const Measurement& a, const Measurement& b) {
+        return a.seconds < b.seconds;
+    });
+    const Measurement& median = runs[runs.size() / 2];
+
+    // ns/op is per thread, so it stays flat when a scenario scales.
+    double nsPerOp = median.seconds * 1e9 * threads / median.ops;
+    double mopsPerSecond = median.ops / median.seconds / 1e6;
+    char syscalls[32];
+    if(allocator.counted) {
+        snprintf(syscalls, sizeof(syscalls), "%zu", median.syscalls);
+    }
+    else {
+        snprintf(syscalls, sizeof(syscalls), "-");
+    }
+    // How much RSS the allocator needed for each byte asked for: the size
+    // classes' rounding and the heap's fragmentation.
+    double rssPerLive = median.peakLive > 0 ? double(median.peakRss) / median.peakLive : 0.0;
+    printf("%-14s %-9s %7zu %10zu %8.1f %9.2f %11zu %9zu %8.2f %9s %9zu\n", name, allocator.name, threads,
+        median.ops, nsPerOp, mopsPerSecond, median.peakRss, median.peakLive, rssPerLive, syscalls, median.faults);
+    fflush(stdout);
+}
+
+// The trace the replay scenario plays back.
+static Replay* s_replay;
+
+static size_t replayTrace(const Allocator& allocator, const Options&, size_t& peakBytes) {
+    peakBytes = s_replay->peakLive;
+    return s_replay->run(allocator);
+}
+
+/**
+ * Replays a trace against both allocators, printing how fragmented each one's
+ * heap was as the replay went along: the RSS it grew by against the bytes the
+ * program had live.
+ */
+static int replay(const char* path, size_t repetitions) {
+    Replay trace;
+    if(!trace.load(path)) {
+        std::cerr << "Can't read the trace " << path << std::endl;
+        return 1;
+    }
+    s_replay = &trace;
+    printf("%s: %zu calls on %zu threads, %zu objects\n", path, trace.calls, trace.threads.size(), trace.objects);
+
+    Options options = {trace.threads.size(), 1, 0};
+    for(const Allocator& allocator : allocators) {
+        printHeader();
+        report("replay", replayTrace, allocator, options, trace.threads.size(), repetitions);
+        printf("  %8s %9s %12s %12s %9s\n", "progress", "ms", "live KB", "RSS KB", "RSS/live");
+        for(size_t i = 0; i < trace.reached; i++) {
+            size_t live = trace.liveAt[i] / 1024;
+            printf("  %7zu%% %9.1f %12zu %12zu %9.2f\n", (i + 1) * 100 / Replay::checkpoints,
+                trace.timeAt[i] * 1000, live, trace.rssAt[i], live > 0 ? double(trace.rssAt[i]) / live : 0.0);
+        }
+    }
+    return 0;
+}
+
 int mainImpl(int argc, const char* argv[]) {
-    
+    Options options;
+    options.threads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+    options.scale = 1;
+    options.size = 0;
+    size_t repetitions = 3;
+    std::vector<std::string> selected;
+
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if((arg == "-t" || arg == "-r" || arg == "-s") && i + 1 < argc) {
+            std::istringstream value(argv[++i]);
+            size_t n = 0;
+            if(!(value >> n) || n == 0) {
+                usage();
+            }
+            (arg == "-t" ? options.threads : arg == "-r" ? repetitions : options.scale) = n;
+        }
+        else if(arg[0] == '-') {
+            usage();
+        }
+        else {
+            selected.push_back(arg);
+        }
+    }
+
+    if(!selected.empty() && selected[0] == "replay") {
+        if(selected.size() != 2) {
+            usage();
+        }
+        return replay(selected[1].c_str(), repetitions);
+    }
+
+    struct Entry {
+        const char* name;
+        Scenario scenario;
+        bool threaded;
+    };
+    const Entry scenarios[] = {
+        {"fixed", fixedSize, false},
+        {"random", randomWalk, false},
+        {"prodcons", producerConsumer, true},
+        {"larson", larson, true},
+        {"threadtest", threadtest, true},
+        {"realloc", reallocGrowth, false},
+    };
+    for(const std::string& name : selected) {
+        if(std::none_of(std::begin(scenarios), std::end(scenarios), [&](const Entry& e) { return name == e.name; })) {
+            usage();
+        }
+    }
+
+    printHeader();
+    for(const Entry& entry : scenarios) {
+        if(!selected.empty() && std::find(selected.begin(), selected.end(), entry.name) == selected.end()) {
+            continue;
+        }
+        size_t threads = 1;
+        if(entry.threaded) {
+            // Producer/consumer runs in pairs.
+            threads = entry.scenario == producerConsumer ? std::max<size_t>(options.threads / 2, 1) * 2 : options.threads;
+        }
+
+        if(entry.scenario != fixedSize) {
+            for(const Allocator& allocator : allocators) {
+                report(entry.name, entry.scenario, allocator, options, threads, repetitions);
+            }
+            continue;
+        }
+        for(size_t c = 0; c < SizeClass::count; c++) {
+            Options sized = options;
+            sized.size = SizeClass::size(c);
+            std::string name = "fixed-" + std::to_string(sized.size);
+            for(const Allocator& allocator : allocators) {
+                report(name.c_str(), entry.scenario, allocator, sized, threads, repetitions);
+            }
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
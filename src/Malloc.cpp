@@ -1,21 +1,597 @@
 #include <Malloc.hpp>
+#include <Trace.hpp>
 #include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+
+// Each thread's store. Stores are mapped directly rather than living in TLS so
+// other threads can still hand frees back to a store after its thread exits.
+static thread_local ArenaStore* t_arenaStore = nullptr;
+
+// Every store there has ever been, newest first, linked through m_nextStore.
+static std::atomic<ArenaStore*> s_stores;
+
+// Stores whose threads have exited, linked through m_nextAbandoned.
+static std::mutex s_abandonedLock;
+static ArenaStore* s_abandoned;
+
+// Its destructor hands the store back when the thread exits.
+static pthread_key_t s_storeKey;
+static pthread_once_t s_storeKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Runs as the thread exits, after its C++ thread_local destructors. Anything
+ * freeing memory after this (other keys' destructors) gets a store again, and
+ * this runs again for it.
+ */
+static void abandon(void* ptr) {
+    ArenaStore* store = static_cast<ArenaStore*>(ptr);
+    store->collect();
+    t_arenaStore = nullptr;
+    std::lock_guard<std::mutex> guard(s_abandonedLock);
+    store->setNextAbandoned(s_abandoned);
+    s_abandoned = store;
+}
+
+static void createStoreKey() {
+    pthread_key_create(&s_storeKey, abandon);
+}
+
+/**
+ * Takes the store an exited thread left most recently, or returns null.
+ */
+static ArenaStore* adopt() {
+    std::lock_guard<std::mutex> guard(s_abandonedLock);
+    ArenaStore* store = s_abandoned;
+    if(store != nullptr) {
+        s_abandoned = store->nextAbandoned();
+    }
+    return store;
+}
+
+template<>
+ArenaStore* ArenaStore::local() {
+    ArenaStore* store = t_arenaStore;
+    if(store == nullptr) {
+        pthread_once(&s_storeKeyOnce, createStoreKey);
+        store = adopt();
+        if(store == nullptr) {
+            void* ptr = mmap(nullptr, sizeof(ArenaStore), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if(ptr == MAP_FAILED) {
+                return nullptr;
+            }
+            store = new (ptr) ArenaStore();
+            ArenaStore* head = s_stores.load(std::memory_order_relaxed);
+            do {
+                store->setNextStore(head);
+            } while(!s_stores.compare_exchange_weak(head, store, std::memory_order_release, std::memory_order_relaxed));
+        }
+        t_arenaStore = store;
+        pthread_setspecific(s_storeKey, store);
+    }
+    return store;
+}
+
+template<>
+ArenaStore* ArenaStore::first() {
+    return s_stores.load(std::memory_order_acquire);
+}
+
+/**
+ * myMalloc() and myFree() without the tracing, for the functions built on
+ * them that trace themselves. Like malloc(), failures set errno to ENOMEM.
+ */
+static void* allocate(size_t n, bool zeroed = false) {
+    ArenaStore* store = ArenaStore::local();
+    void* result = nullptr;
+    if(store != nullptr) {
+        result = zeroed ? store->allocZeroed(n) : store->alloc(n);
+    }
+    if(result == nullptr) {
+        errno = ENOMEM;
+    }
+    return result;
+}
+
+/**
+ * Allocates `n` bytes aligned to `alignment`, a power of two, and traces it.
+ */
+static void* allocateAligned(size_t n, size_t alignment, bool zeroed) {
+    ArenaStore* store = ArenaStore::local();
+    void* result = nullptr;
+    if(store != nullptr) {
+        result = store->allocAligned(n, alignment, zeroed);
+    }
+    if(result == nullptr) {
+        errno = ENOMEM;
+    }
+    if(Trace::enabled() && result != nullptr) {
+        Trace::record(Trace::Malloc, result, n);
+    }
+    return result;
+}
+
+/**
+ * Frees through the calling thread's store, or straight back to the owner if
+ * it couldn't get one.
+ */
+static void release(void* addr) {
+    ArenaStore* store = ArenaStore::local();
+    if(store == nullptr) {
+        ArenaStore::freeWithoutStore(addr);
+        return;
+    }
+    store->free(addr);
+}
 
 /**
  * Your special drop-in replacement for malloc(). Should behave the same way.
  */
-ArenaStore myArenaStore;
 void* myMalloc(size_t n) {
-    // TODO: implement myMalloc
-    return myArenaStore.alloc(n);
+    void* result = allocate(n);
+    if(Trace::enabled() && result != nullptr) {
+        Trace::record(Trace::Malloc, result, n);
+    }
+    return result;
 }
 
 /**
  * Your special drop-in replacement for free(). Should behave the same way.
  */
 void myFree(void* addr) {
-    // TODO: implement myFree
-    myArenaStore.free(addr);
+    if(addr == nullptr) {
+        return;
+    }
+    if(Trace::enabled()) {
+        Trace::record(Trace::Free, addr, 0);
+    }
+    release(addr);
+}
+
+/**
+ * Like myFree(), but for a pointer that came from myMalloc(n).
+ */
+void myFreeSized(void* addr, size_t n) {
+    if(addr == nullptr) {
+        return;
+    }
+    if(Trace::enabled()) {
+        Trace::record(Trace::Free, addr, 0);
+    }
+    ArenaStore* store = ArenaStore::local();
+    if(store == nullptr) {
+        ArenaStore::freeWithoutStore(addr);
+        return;
+    }
+    store->freeSized(addr, n);
+}
+
+/**
+ * Allocates `count` blocks of `n` bytes at once. See Malloc.hpp.
+ */
+size_t myMallocBatch(size_t n, size_t count, void** out) {
+    ArenaStore* store = ArenaStore::local();
+    if(store == nullptr) {
+        return 0;
+    }
+    size_t result = store->allocBatch(n, count, out);
+    if(Trace::enabled()) {
+        for(size_t i = 0; i < result; i++) {
+            Trace::record(Trace::Malloc, out[i], n);
+        }
+    }
+    return result;
+}
+
+/**
+ * Frees `count` pointers at once. See Malloc.hpp.
+ */
+void myFreeBatch(void** ptrs, size_t count) {
+    if(Trace::enabled()) {
+        for(size_t i = 0; i < count; i++) {
+            if(ptrs[i] != nullptr) {
+                Trace::record(Trace::Free, ptrs[i], 0);
+            }
+        }
+    }
+    ArenaStore* store = ArenaStore::local();
+    if(store == nullptr) {
+        for(size_t i = 0; i < count; i++) {
+            if(ptrs[i] != nullptr) {
+                ArenaStore::freeWithoutStore(ptrs[i]);
+            }
+        }
+        return;
+    }
+    store->freeBatch(ptrs, count);
+}
+
+/**
+ * Your special drop-in replacement for realloc(). Should behave the same way.
+ */
+void* myRealloc(void* addr, size_t n) {
+    if(addr == nullptr) {
+        return myMalloc(n);
+    }
+    if(n == 0) {
+        myFree(addr);
+        return nullptr;
+    }
+
+    const PageMap::Entry* entry = PageMap::lookup(addr);
+    size_t oldSize;
+    if(entry->arenaSize != 0) {
+        // Anything that still fits in the slot stays where it is.
+        if(n <= entry->arenaSize) {
+            if(Trace::enabled()) {
+                Trace::recordRealloc(addr, addr, n);
+            }
+            return addr;
+        }
+        oldSize = entry->arenaSize;
+    }
+    else {
+        // Samples stay put so the profile keeps track of them.
+        ArenaStore* store = ArenaStore::local();
+        if(store != nullptr && n > SizeClass::maxSize && BigAlloc::sample(addr) == BigAlloc::unsampled) {
+            void* moved = store->reallocBig(addr, n);
+            if(moved != nullptr) {
+                if(Trace::enabled()) {
+                    Trace::recordRealloc(addr, moved, n);
+                }
+                return moved;
+            }
+        }
+        oldSize = BigAlloc::size(addr);
+    }
+
+    void* result = allocate(n);
+    if(result == nullptr) {
+        return nullptr;
+    }
+    memcpy(result, addr, oldSize < n ? oldSize : n);
+    if(Trace::enabled()) {
+        Trace::recordRealloc(addr, result, n);
+    }
+    release(addr);
+    return result;
+}
+
+/**
+ * Your special drop-in replacement for calloc(). Should behave the same way.
+ */
+void* myCalloc(size_t count, size_t n) {
+    size_t bytes;
+    if(__builtin_mul_overflow(count, n, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void* result = allocate(bytes, true);
+    if(Trace::enabled() && result != nullptr) {
+        Trace::record(Trace::Malloc, result, bytes);
+    }
+    return result;
+}
+
+/**
+ * Your special drop-in replacement for aligned_alloc(). Should behave the same way.
+ */
+void* myAlignedAlloc(size_t alignment, size_t n) {
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return allocateAligned(n, alignment, false);
+}
+
+/**
+ * Allocates memory aligned like malloc()'s. See Malloc.hpp.
+ */
+void* myMallocMaxAligned(size_t n) {
+    return allocateAligned(n, alignof(max_align_t), false);
+}
+
+/**
+ * Allocates zeroed memory aligned like calloc()'s. See Malloc.hpp.
+ */
+void* myCallocMaxAligned(size_t count, size_t n) {
+    size_t bytes;
+    if(__builtin_mul_overflow(count, n, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return allocateAligned(bytes, alignof(max_align_t), true);
+}
+
+/**
+ * Allocates whole cache lines. See Malloc.hpp.
+ */
+void* myMallocCacheAligned(size_t n) {
+    size_t lines = (n + cacheLineSize - 1) / cacheLineSize;
+    return myAlignedAlloc(cacheLineSize, (lines > 0 ? lines : 1) * cacheLineSize);
+}
+
+/**
+ * Your special drop-in replacement for posix_memalign(). Should behave the same way.
+ */
+int myPosixMemalign(void** out, size_t alignment, size_t n) {
+    if(alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* result = myAlignedAlloc(alignment, n);
+    if(result == nullptr) {
+        return ENOMEM;
+    }
+    *out = result;
+    return 0;
+}
+
+/**
+ * Your special drop-in replacement for malloc_usable_size(). Should behave the
+ * same way.
+ */
+size_t myMallocUsableSize(void* addr) {
+    if(addr == nullptr) {
+        return 0;
+    }
+    const PageMap::Entry* entry = PageMap::lookup(addr);
+    return entry->arenaSize != 0 ? entry->arenaSize : BigAlloc::size(addr);
+}
+
+void myMallocCollect() {
+    ArenaStore* store = ArenaStore::local();
+    if(store != nullptr) {
+        store->collect();
+    }
+}
+
+size_t myMallocWalkLive(void (*visit)(void* ptr, size_t size, void* arg), void* arg) {
+    ArenaStore* store = ArenaStore::local();
+    if(store == nullptr) {
+        return 0;
+    }
+    return store->forEachLive([visit, arg](void* ptr, size_t size) { visit(ptr, size, arg); });
+}
+
+size_t myMallocTrim() {
+    ArenaStore* local = ArenaStore::local();
+    if(local != nullptr) {
+        local->collect();
+    }
+    for(ArenaStore* store = ArenaStore::first(); store != nullptr; store = store->nextStore()) {
+        store->purgeCaches(true);
+    }
+    return PageReserve::decommit() * pageSize;
+}
+
+// The background purger's thread, if it's running. Starting and stopping it
+// is serialized by s_purgerLock.
+static std::mutex s_purgerLock;
+static pthread_t s_purger;
+static std::atomic<bool> s_purging;
+
+static void* purgeInBackground(void*) {
+    // Wake often enough to follow the PageReserve's decay curve.
+    uint64_t tick = ArenaStore::decayMillis / 16 > 0 ? ArenaStore::decayMillis / 16 : 1;
+    timespec interval = {static_cast<time_t>(tick / 1000), static_cast<long>(tick % 1000 * 1000000)};
+    while(s_purging.load(std::memory_order_relaxed)) {
+        nanosleep(&interval, nullptr);
+        for(ArenaStore* store = ArenaStore::first(); store != nullptr; store = store->nextStore()) {
+            store->purgeCaches(false);
+        }
+        PageReserve::purge();
+    }
+    return nullptr;
+}
+
+// A forked child doesn't get the purger's thread.
+static void forgetPurger() {
+    s_purging.store(false, std::memory_order_relaxed);
+}
+
+bool myMallocBackgroundPurge(bool enable) {
+    std::lock_guard<std::mutex> guard(s_purgerLock);
+    if(enable == s_purging.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if(!enable) {
+        s_purging.store(false, std::memory_order_relaxed);
+        pthread_join(s_purger, nullptr);
+        return true;
+    }
+    static bool registered = false;
+    if(!registered) {
+        pthread_atfork(nullptr, nullptr, forgetPurger);
+        registered = true;
+    }
+    s_purging.store(true, std::memory_order_relaxed);
+    if(pthread_create(&s_purger, nullptr, purgeInBackground, nullptr) != 0) {
+        s_purging.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+size_t myMallocHugePageBytes() {
+    // Read into a stack buffer; this must not allocate.
+    char buffer[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 0;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if(length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    const char* field = strstr(buffer, "AnonHugePages:");
+    if(field == nullptr) {
+        return 0;
+    }
+    return strtoull(field + strlen("AnonHugePages:"), nullptr, 10) * 1024;
+}
+
+MallocStats myMallocStats() {
+    MallocStats stats = {};
+    for(ArenaStore* store = ArenaStore::first(); store != nullptr; store = store->nextStore()) {
+        const ArenaStore::Stats& shard = store->stats();
+        for(size_t c = 0; c < SizeClass::count; c++) {
+            const ArenaStore::ClassStats& counters = shard.classes[c];
+            MallocClassStats& total = stats.classes[c];
+            total.allocs += counters.allocs.load();
+            total.frees += counters.frees.load() + counters.remoteFrees.load();
+            total.crossThreadFrees += counters.remoteFrees.load();
+            total.bytesRequested += counters.bytesRequested.load();
+            total.arenas += counters.arenasCreated.load() - counters.arenasReleased.load();
+        }
+        stats.bigAllocs += shard.bigAllocs.load();
+        stats.bigFrees += shard.bigFrees.load();
+        stats.bigBytesLive += shard.bigBytesAllocated.load() - shard.bigBytesFreed.load();
+        stats.threads++;
+    }
+
+    // Shards are read one counter at a time, so a free can be seen without its
+    // alloc. Clamp rather than report a wrapped count.
+    for(size_t c = 0; c < SizeClass::count; c++) {
+        MallocClassStats& total = stats.classes[c];
+        total.size = SizeClass::size(c);
+        total.liveSlots = total.allocs > total.frees ? total.allocs - total.frees : 0;
+        total.bytesAllocated = total.allocs * total.size;
+        total.bytesReserved = total.arenas * SizeClass::spanPages(c) * pageSize;
+        stats.bytesRequested += total.bytesRequested;
+        stats.bytesAllocated += total.bytesAllocated;
+        stats.bytesReserved += total.bytesReserved;
+    }
+    stats.bytesReserved += stats.bigBytesLive;
+    stats.mmapCalls = MMapObject::mmapCalls();
+    stats.munmapCalls = MMapObject::munmapCalls();
+    stats.reserveSyscalls = PageReserve::syscalls();
+    stats.outstandingPages = MMapObject::outstandingPages();
+    return stats;
+}
+
+/**
+ * snprintf() onto the end of what's been written so far, tracking the length
+ * the whole dump would have.
+ */
+static void append(char* buffer, size_t size, size_t& length, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    char* end = length < size ? buffer + length : nullptr;
+    int written = vsnprintf(end, end != nullptr ? size - length : 0, format, args);
+    va_end(args);
+    if(written > 0) {
+        length += written;
+    }
+}
+
+size_t myMallocStatsDump(char* buffer, size_t size, bool json) {
+    MallocStats stats = myMallocStats();
+    size_t length = 0;
+    if(size > 0) {
+        buffer[0] = '\0';
+    }
+
+    if(json) {
+        append(buffer, size, length, "{\"classes\":[");
+        bool first = true;
+        for(const MallocClassStats& c : stats.classes) {
+            append(buffer, size, length,
+                "%s{\"size\":%zu,\"allocs\":%lu,\"frees\":%lu,\"crossThreadFrees\":%lu,\"liveSlots\":%lu,"
+                "\"arenas\":%lu,\"bytesRequested\":%lu,\"bytesAllocated\":%lu,\"bytesReserved\":%lu}",
+                first ? "" : ",", c.size, c.allocs, c.frees, c.crossThreadFrees, c.liveSlots,
+                c.arenas, c.bytesRequested, c.bytesAllocated, c.bytesReserved);
+            first = false;
+        }
+        append(buffer, size, length,
+            "],\"bigAllocs\":%lu,\"bigFrees\":%lu,\"bigBytesLive\":%lu,\"bytesRequested\":%lu,"
+            "\"bytesAllocated\":%lu,\"bytesReserved\":%lu,\"mmapCalls\":%lu,\"munmapCalls\":%lu,"
+            "\"reserveSyscalls\":%lu,\"threads\":%lu,\"outstandingPages\":%lu}\n",
+            stats.bigAllocs, stats.bigFrees, stats.bigBytesLive, stats.bytesRequested,
+            stats.bytesAllocated, stats.bytesReserved, stats.mmapCalls, stats.munmapCalls,
+            stats.reserveSyscalls, stats.threads, stats.outstandingPages);
+        return length;
+    }
+
+    append(buffer, size, length, "%6s %10s %10s %10s %10s %7s %12s %12s %12s\n",
+        "size", "allocs", "frees", "remote", "live", "arenas", "requested", "allocated", "reserved");
+    for(const MallocClassStats& c : stats.classes) {
+        if(c.allocs == 0 && c.arenas == 0) {
+            continue;
+        }
+        append(buffer, size, length, "%6zu %10lu %10lu %10lu %10lu %7lu %12lu %12lu %12lu\n",
+            c.size, c.allocs, c.frees, c.crossThreadFrees, c.liveSlots, c.arenas,
+            c.bytesRequested, c.bytesAllocated, c.bytesReserved);
+    }
+    append(buffer, size, length, "big: %lu allocs, %lu frees, %lu bytes live\n",
+        stats.bigAllocs, stats.bigFrees, stats.bigBytesLive);
+    append(buffer, size, length, "total: %lu bytes requested, %lu allocated, %lu reserved\n",
+        stats.bytesRequested, stats.bytesAllocated, stats.bytesReserved);
+    append(buffer, size, length, "syscalls: %lu mmap, %lu munmap, %lu reserve\n",
+        stats.mmapCalls, stats.munmapCalls, stats.reserveSyscalls);
+    append(buffer, size, length, "threads: %lu, outstanding pages: %lu\n",
+        stats.threads, stats.outstandingPages);
+    return length;
+}
+
+void myMallocSetSampleRate(size_t bytes) {
+    HeapProfiler::setSampleBytes(bytes);
+    ArenaStore* store = ArenaStore::local();
+    if(store != nullptr) {
+        store->resetSampling();
+    }
+}
+
+size_t myMallocProfileDump(int fd) {
+    return HeapProfiler::dump(fd);
+}
+
+bool myMallocTraceStart(const char* path, size_t events) {
+    return Trace::start(path, events);
+}
+
+void myMallocTraceStop() {
+    Trace::stop();
+}
+
+// The newest store when the fork began. Stores are only ever added at the
+// front, so the ones locked are the ones from here on.
+static ArenaStore* s_forkStores;
+
+void myMallocPrepareFork() {
+    // In the order everything else takes them: a store's cache lock is held
+    // while it gives spans back to the reserve.
+    s_abandonedLock.lock();
+    s_forkStores = ArenaStore::first();
+    for(ArenaStore* store = s_forkStores; store != nullptr; store = store->nextStore()) {
+        store->lockForFork();
+    }
+    HeapProfiler::lockForFork();
+    PageReserve::lockForFork();
+}
+
+void myMallocParentAfterFork() {
+    PageReserve::unlockAfterFork();
+    HeapProfiler::unlockAfterFork();
+    for(ArenaStore* store = s_forkStores; store != nullptr; store = store->nextStore()) {
+        store->unlockAfterFork();
+    }
+    s_abandonedLock.unlock();
+}
+
+void myMallocChildAfterFork() {
+    // Only the forking thread carries on, and it took the locks itself.
+    myMallocParentAfterFork();
 }
 
-std::atomic<size_t> MMapObject::s_outstandingPages = 0;
\ No newline at end of file
+std::atomic<size_t> MMapObject::s_outstandingPages = 0;
+std::atomic<size_t> MMapObject::s_mmapCalls = 0;
+std::atomic<size_t> MMapObject::s_munmapCalls = 0;
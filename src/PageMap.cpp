@@ -0,0 +1,76 @@
+#include <PageMap.hpp>
+#include <sys/mman.h>
+#include <new>
+
+std::atomic<PageMap::Mid*> PageMap::s_root[1 << PageMap::rootBits];
+
+/**
+ * Maps a zeroed node, or returns null on failure. The map is consulted on every
+ * MMapObject allocation, so it can't use our own allocator.
+ */
+template <typename T> static T* mapNode() {
+    void* ptr = mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ptr == MAP_FAILED) {
+        return nullptr;
+    }
+    return new (ptr) T();
+}
+
+/**
+ * Returns the child stored in slot, installing a fresh one if there is none.
+ * If another thread races us to it, theirs wins and ours is unmapped.
+ */
+template <typename T> static T* getOrCreate(std::atomic<T*>& slot) {
+    T* node = slot.load(std::memory_order_acquire);
+    if(node != nullptr) {
+        return node;
+    }
+    T* fresh = mapNode<T>();
+    if(fresh == nullptr) {
+        return nullptr;
+    }
+    if(!slot.compare_exchange_strong(node, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        munmap(fresh, sizeof(T));
+        return node;
+    }
+    return fresh;
+}
+
+PageMap::Entry* PageMap::entryFor(uintptr_t page) {
+    if(rootIndex(page) >= (1 << rootBits)) {
+        return nullptr;
+    }
+    Mid* mid = getOrCreate(s_root[rootIndex(page)]);
+    if(mid == nullptr) {
+        return nullptr;
+    }
+    Leaf* leaf = getOrCreate(mid->leaves[midIndex(page)]);
+    if(leaf == nullptr) {
+        return nullptr;
+    }
+    return &leaf->entries[leafIndex(page)];
+}
+
+bool PageMap::set(void* start, size_t pages, const Entry& entry) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(start) >> pageShift;
+    for(uintptr_t page = first; page < first + pages; page++) {
+        Entry* slot = entryFor(page);
+        if(slot == nullptr) {
+            clear(start, page - first);
+            return false;
+        }
+        *slot = entry;
+    }
+    return true;
+}
+
+void PageMap::clear(void* start, size_t pages) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(start) >> pageShift;
+    for(uintptr_t page = first; page < first + pages; page++) {
+        // Registered pages always have their nodes, so this never maps anything.
+        Entry* slot = entryFor(page);
+        if(slot != nullptr) {
+            *slot = Entry();
+        }
+    }
+}
@@ -0,0 +1,465 @@
+#include <PageReserve.hpp>
+#include <Malloc.hpp>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+
+static constexpr size_t reservationPages = PageReserve::reservationSize / pageSize;
+
+static std::mutex s_lock;
+
+// The start of the reservation, or null until the first span is asked for.
+static std::atomic<char*> s_base;
+static bool s_reserveFailed;
+
+// The reservation is split into a slice per NUMA node, each with its own bump
+// pointer and free lists, so spans stay on the node that first asked for them.
+struct Node {
+    // The node's slice, as page indices into the reservation.
+    size_t start;
+    size_t end;
+    // Pages handed out by the bump pointer, and pages committed so far.
+    size_t top;
+    size_t committed;
+    // Heads of the free lists for each span size, as page index + 1. Dirty
+    // spans are still resident, newest first; clean ones have been lazily
+    // freed, so may or may not still hold what they did; zero ones have been
+    // given back with MADV_DONTNEED, so read as zero.
+    uint32_t dirty[maxMediumPages + 1];
+    uint32_t clean[maxMediumPages + 1];
+    uint32_t zero[maxMediumPages + 1];
+};
+static Node s_nodes[PageReserve::maxNodes];
+static size_t s_nodeCount;
+static size_t s_slicePages;
+
+// What we track for free spans, indexed by the span's first page.
+struct FreeSpan {
+    // The page index + 1 of the next free span of the same size. Zero ends a list.
+    uint32_t next;
+    // When the span was freed, in (truncated) monotonicMillis().
+    uint32_t freedAt;
+};
+static FreeSpan* s_freeSpans;
+
+static size_t s_dirtyPages;
+
+// When to next look for dirty spans older than MALLOC_DECAY_MS.
+static uint64_t s_nextPurge;
+
+static std::atomic<size_t> s_syscalls;
+
+/**
+ * The number of NUMA nodes we may allocate on, up to PageReserve::maxNodes.
+ * This is one if the kernel has no NUMA support or won't tell us.
+ */
+static size_t numaNodes() {
+    if(PageReserve::maxNodes == 1) {
+        return 1;
+    }
+    unsigned long mask[16] = {};
+    s_syscalls++;
+    if(syscall(SYS_get_mempolicy, nullptr, mask, sizeof(mask) * 8, nullptr, MPOL_F_MEMS_ALLOWED) != 0) {
+        return 1;
+    }
+    size_t nodes = 1;
+    for(size_t node = 0; node < sizeof(mask) * 8; node++) {
+        if(mask[node / (sizeof(long) * 8)] & (1UL << (node % (sizeof(long) * 8)))) {
+            nodes = node + 1;
+        }
+    }
+    return nodes < PageReserve::maxNodes ? nodes : PageReserve::maxNodes;
+}
+
+static bool reserve() {
+    if(s_reserveFailed) {
+        return false;
+    }
+    // Slices are whole commit batches, so batches never straddle two nodes.
+    s_nodeCount = numaNodes();
+    s_slicePages = reservationPages / s_nodeCount / PageReserve::commitBatchPages * PageReserve::commitBatchPages;
+    for(size_t node = 0; node < s_nodeCount; node++) {
+        s_nodes[node].start = s_nodes[node].top = s_nodes[node].committed = node * s_slicePages;
+        s_nodes[node].end = (node + 1) * s_slicePages;
+    }
+    s_syscalls += 2;
+    size_t slop = PageReserve::hugePages ? PageReserve::hugePageSize : 0;
+    void* base = mmap(nullptr, PageReserve::reservationSize + slop, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    void* table = mmap(nullptr, reservationPages * sizeof(FreeSpan), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED || table == MAP_FAILED) {
+        if(base != MAP_FAILED) {
+            munmap(base, PageReserve::reservationSize + slop);
+        }
+        if(table != MAP_FAILED) {
+            munmap(table, reservationPages * sizeof(FreeSpan));
+        }
+        s_reserveFailed = true;
+        return false;
+    }
+    if(PageReserve::hugePages) {
+        // Trim the reservation down to a huge page aligned range.
+        char* raw = static_cast<char*>(base);
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + slop - 1) & ~(slop - 1));
+        if(aligned != raw) {
+            s_syscalls++;
+            munmap(raw, aligned - raw);
+        }
+        if(aligned != raw + slop) {
+            s_syscalls++;
+            munmap(aligned + PageReserve::reservationSize, raw + slop - aligned);
+        }
+        s_syscalls++;
+        madvise(aligned, PageReserve::reservationSize, MADV_HUGEPAGE);
+        base = aligned;
+    }
+    s_freeSpans = static_cast<FreeSpan*>(table);
+    s_base.store(static_cast<char*>(base), std::memory_order_release);
+    return true;
+}
+
+static char* pageAddress(uint32_t entry) {
+    return s_base.load(std::memory_order_relaxed) + (entry - 1) * pageSize;
+}
+
+static uint32_t pageEntry(void* ptr) {
+    return static_cast<uint32_t>((static_cast<char*>(ptr) - s_base.load(std::memory_order_relaxed)) / pageSize + 1);
+}
+
+static void push(uint32_t& head, void* span) {
+    uint32_t entry = pageEntry(span);
+    s_freeSpans[entry - 1].next = head;
+    head = entry;
+}
+
+static void* pop(uint32_t& head) {
+    uint32_t entry = head;
+    head = s_freeSpans[entry - 1].next;
+    return pageAddress(entry);
+}
+
+/**
+ * The slice a span of the reservation belongs to.
+ */
+static Node& nodeOf(const void* span) {
+    return s_nodes[(pageEntry(const_cast<void*>(span)) - 1) / s_slicePages];
+}
+
+/**
+ * The slice for the node the calling thread is running on. Nodes past the last
+ * slice share the slices round robin.
+ */
+static Node& localNode() {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if(s_nodeCount == 1 || getcpu(&cpu, &node) != 0) {
+        return s_nodes[0];
+    }
+    return s_nodes[node % s_nodeCount];
+}
+
+/**
+ * Commits the next batch of a node's slice, preferring that node's memory for
+ * it if there's more than one.
+ */
+static bool commitLocked(Node& node) {
+    size_t batch = PageReserve::commitBatchPages;
+    if(node.committed + batch > node.end) {
+        batch = node.end - node.committed;
+    }
+    char* start = s_base.load(std::memory_order_relaxed) + node.committed * pageSize;
+    s_syscalls++;
+    if(mprotect(start, batch * pageSize, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    if(s_nodeCount > 1) {
+        unsigned long mask = 1UL << (&node - s_nodes);
+        s_syscalls++;
+        syscall(SYS_mbind, start, batch * pageSize, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+    node.committed += batch;
+    return true;
+}
+
+/**
+ * Lets the OS reclaim a span's pages whenever it wants with MADV_FREE, which is
+ * cheaper than MADV_DONTNEED when they are reused before that happens. Falls
+ * back to MADV_DONTNEED where MADV_FREE isn't supported. Returns true if it
+ * did, in which case the span now reads as zero.
+ */
+static bool lazyFree(void* span, size_t pages) {
+    s_syscalls++;
+#ifdef MADV_FREE
+    if(madvise(span, pages * pageSize, MADV_FREE) == 0) {
+        return false;
+    }
+    s_syscalls++;
+#endif
+    return madvise(span, pages * pageSize, MADV_DONTNEED) == 0;
+}
+
+// How many times per decay interval the dirty lists are walked.
+static constexpr uint64_t purgesPerDecay = 16;
+
+/**
+ * Whether a span that has been free for `age` milliseconds is due to be purged.
+ * Like jemalloc's dirty_decay_ms, spans aren't all kept for MALLOC_DECAY_MS and
+ * then dropped at once: the fraction of them purged follows a smoothstep curve
+ * from none when freed to all at MALLOC_DECAY_MS, so RSS falls away gradually
+ * after a spike. Each span's point on the curve comes from a hash of its
+ * position, so the same span always decays at the same age.
+ */
+static bool decayed(uint32_t entry, uint32_t age) {
+    constexpr uint64_t one = 1024;
+    if(age >= ArenaStore::decayMillis) {
+        return true;
+    }
+    uint64_t x = age * one / ArenaStore::decayMillis;
+    uint64_t curve = x * x * (3 * one - 2 * x) / (one * one);
+    uint64_t threshold = ((entry * 0x9e3779b1u) >> 16) % one;
+    return curve > threshold;
+}
+
+/**
+ * Spans taken off the dirty lists to be given back to the OS once the lock is
+ * dropped, by size, linked through the side table like the lists.
+ */
+struct Batch {
+    uint32_t spans[maxMediumPages + 1];
+};
+
+/**
+ * Moves the dirty spans that have decayed into `batch` to be lazily freed. This
+ * walks the lists at most purgesPerDecay times per decay interval.
+ */
+static void takeDecayedLocked(uint64_t now, Batch& batch) {
+    if(now < s_nextPurge) {
+        return;
+    }
+    s_nextPurge = now + ArenaStore::decayMillis / purgesPerDecay;
+    for(size_t i = 0; i < s_nodeCount; i++) {
+        Node& node = s_nodes[i];
+        for(size_t pages = 1; pages <= maxMediumPages; pages++) {
+            uint32_t* link = &node.dirty[pages];
+            while(*link != 0) {
+                uint32_t entry = *link;
+                if(!decayed(entry, static_cast<uint32_t>(now) - s_freeSpans[entry - 1].freedAt)) {
+                    link = &s_freeSpans[entry - 1].next;
+                    continue;
+                }
+                push(batch.spans[pages], pop(*link));
+                s_dirtyPages -= pages;
+            }
+        }
+    }
+}
+
+/**
+ * Moves every dirty span into `batch`.
+ */
+static void takeAllLocked(Batch& batch) {
+    for(size_t i = 0; i < s_nodeCount; i++) {
+        Node& node = s_nodes[i];
+        for(size_t pages = 1; pages <= maxMediumPages; pages++) {
+            while(node.dirty[pages] != 0) {
+                push(batch.spans[pages], pop(node.dirty[pages]));
+            }
+        }
+    }
+    s_dirtyPages = 0;
+}
+
+/**
+ * Gives a batch's spans back to the OS, lazily or with MADV_DONTNEED, without
+ * the lock, then takes it to put them on their nodes' clean or zero lists.
+ * Nobody else can see the spans in between, so their side table entries are
+ * ours until then.
+ */
+static void giveBack(Batch& batch, bool lazily) {
+    Batch zero = {};
+    Batch clean = {};
+    bool any = false;
+    for(size_t pages = 1; pages <= maxMediumPages; pages++) {
+        while(batch.spans[pages] != 0) {
+            void* span = pop(batch.spans[pages]);
+            bool zeroed;
+            if(lazily) {
+                zeroed = lazyFree(span, pages);
+            }
+            else {
+                s_syscalls++;
+                zeroed = madvise(span, pages * pageSize, MADV_DONTNEED) == 0;
+            }
+            push(zeroed ? zero.spans[pages] : clean.spans[pages], span);
+            any = true;
+        }
+    }
+    if(!any) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(s_lock);
+    for(size_t pages = 1; pages <= maxMediumPages; pages++) {
+        while(zero.spans[pages] != 0) {
+            void* span = pop(zero.spans[pages]);
+            push(nodeOf(span).zero[pages], span);
+        }
+        while(clean.spans[pages] != 0) {
+            void* span = pop(clean.spans[pages]);
+            push(nodeOf(span).clean[pages], span);
+        }
+    }
+}
+
+/**
+ * Takes `pages` pages off the front of the smallest free span of the node's
+ * that's bigger, putting the rest back on the list for its size like it was.
+ * Returns null if there's none.
+ */
+static void* splitLocked(Node& node, size_t pages, bool* zero) {
+    uint32_t (*lists[])[maxMediumPages + 1] = { &node.dirty, &node.clean, &node.zero };
+    for(size_t larger = pages + 1; larger <= maxMediumPages; larger++) {
+        for(auto list : lists) {
+            if((*list)[larger] == 0) {
+                continue;
+            }
+            char* span = static_cast<char*>(pop((*list)[larger]));
+            char* rest = span + pages * pageSize;
+            push((*list)[larger - pages], rest);
+            if(list == &node.dirty) {
+                s_freeSpans[pageEntry(rest) - 1].freedAt = s_freeSpans[pageEntry(span) - 1].freedAt;
+                s_dirtyPages -= pages;
+            }
+            *zero = list == &node.zero;
+            return span;
+        }
+    }
+    return nullptr;
+}
+
+void* PageReserve::allocSpan(size_t pages, bool* zero) {
+    std::lock_guard<std::mutex> guard(s_lock);
+
+    if(s_base.load(std::memory_order_relaxed) == nullptr && !reserve()) {
+        return nullptr;
+    }
+    Node& node = localNode();
+    bool known = false;
+    if(zero == nullptr) {
+        zero = &known;
+    }
+    *zero = false;
+    if(node.dirty[pages] != 0) {
+        s_dirtyPages -= pages;
+        return pop(node.dirty[pages]);
+    }
+    if(node.clean[pages] != 0) {
+        return pop(node.clean[pages]);
+    }
+    *zero = true;
+    if(node.zero[pages] != 0) {
+        return pop(node.zero[pages]);
+    }
+    // Once a node's slice runs out, bigger free spans are split, and after
+    // that the caller's mmap at least gets memory on the node that touches it
+    // first.
+    if(node.top + pages > node.end || (node.top + pages > node.committed && !commitLocked(node))) {
+        return splitLocked(node, pages, zero);
+    }
+    char* span = s_base.load(std::memory_order_relaxed) + node.top * pageSize;
+    node.top += pages;
+    return span;
+}
+
+void PageReserve::freeSpan(void* ptr, size_t pages) {
+    uint64_t now = monotonicMillis();
+    Batch decayed = {};
+    bool kept;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        // Spans always go back to their own node's lists, whoever frees them.
+        kept = s_dirtyPages + pages <= maxDirtyPages;
+        if(kept) {
+            push(nodeOf(ptr).dirty[pages], ptr);
+            s_freeSpans[pageEntry(ptr) - 1].freedAt = static_cast<uint32_t>(now);
+            s_dirtyPages += pages;
+        }
+        takeDecayedLocked(now, decayed);
+    }
+    // Past maxDirtyPages only this span is given back, rather than all of
+    // them; the rest are left to decay.
+    if(!kept) {
+        Batch span = {};
+        push(span.spans[pages], ptr);
+        giveBack(span, false);
+    }
+    giveBack(decayed, true);
+}
+
+bool PageReserve::contains(const void* ptr) {
+    const char* base = s_base.load(std::memory_order_acquire);
+    const char* p = static_cast<const char*>(ptr);
+    return base != nullptr && p >= base && p < base + reservationSize;
+}
+
+void PageReserve::purge() {
+    Batch decayed = {};
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        if(s_base.load(std::memory_order_relaxed) == nullptr) {
+            return;
+        }
+        takeDecayedLocked(monotonicMillis(), decayed);
+    }
+    giveBack(decayed, true);
+}
+
+size_t PageReserve::decommit() {
+    Batch dirty = {};
+    size_t pages;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        pages = s_dirtyPages;
+        takeAllLocked(dirty);
+    }
+    giveBack(dirty, false);
+    return pages;
+}
+
+size_t PageReserve::committedPages() {
+    std::lock_guard<std::mutex> guard(s_lock);
+    size_t committed = 0;
+    for(size_t node = 0; node < s_nodeCount; node++) {
+        committed += s_nodes[node].committed - s_nodes[node].start;
+    }
+    return committed;
+}
+
+size_t PageReserve::nodes() {
+    std::lock_guard<std::mutex> guard(s_lock);
+    return s_nodeCount;
+}
+
+size_t PageReserve::node(const void* ptr) {
+    std::lock_guard<std::mutex> guard(s_lock);
+    return &nodeOf(ptr) - s_nodes;
+}
+
+size_t PageReserve::dirtyPages() {
+    std::lock_guard<std::mutex> guard(s_lock);
+    return s_dirtyPages;
+}
+
+size_t PageReserve::syscalls() {
+    return s_syscalls.load();
+}
+
+void PageReserve::lockForFork() {
+    s_lock.lock();
+}
+
+void PageReserve::unlockAfterFork() {
+    s_lock.unlock();
+}
@@ -0,0 +1,143 @@
+#include <Trace.hpp>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <mutex>
+
+static_assert(sizeof(Trace::Header) == 4096, "The trace header takes a page");
+static_assert(sizeof(Trace::Event) == 16, "Trace events should stay compact");
+
+constexpr char Trace::magic[8];
+
+std::atomic<bool> Trace::s_enabled;
+
+static std::mutex s_lock;
+
+// The trace being recorded into. Earlier ones stay mapped.
+static std::atomic<Trace::Header*> s_header;
+
+// The calling thread's number in the trace, or zero until it first records.
+static thread_local uint16_t t_thread;
+static std::atomic<uint16_t> s_threads;
+
+bool Trace::start(const char* path, size_t events) {
+    std::lock_guard<std::mutex> guard(s_lock);
+    if(enabled() || events < 2) {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+    size_t size = sizeof(Header) + events * sizeof(Event);
+    void* map = MAP_FAILED;
+    if(ftruncate(fd, size) == 0) {
+        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(map == MAP_FAILED) {
+        return false;
+    }
+
+    Header* header = static_cast<Header*>(map);
+    memcpy(header->magic, magic, sizeof(magic));
+    header->capacity = events;
+    header->next.store(0, std::memory_order_relaxed);
+    s_header.store(header, std::memory_order_release);
+    s_enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+void Trace::stop() {
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_enabled.store(false, std::memory_order_relaxed);
+    Header* header = s_header.load(std::memory_order_relaxed);
+    if(header != nullptr) {
+        msync(header, sizeof(Header) + header->capacity * sizeof(Event), MS_ASYNC);
+    }
+}
+
+/**
+ * Takes `count` adjacent slots and returns the first, or null if there's no
+ * trace.
+ */
+static Trace::Event* claim(uint64_t count) {
+    Trace::Header* header = s_header.load(std::memory_order_acquire);
+    if(header == nullptr) {
+        return nullptr;
+    }
+    if(t_thread == 0) {
+        t_thread = s_threads.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    Trace::Event* events = reinterpret_cast<Trace::Event*>(header + 1);
+    uint64_t slot = header->next.fetch_add(count, std::memory_order_relaxed);
+    // A pair mustn't straddle the end of the ring, so the slots of one that
+    // would are left as Nones and it takes the next ones instead.
+    while(slot % header->capacity + count > header->capacity) {
+        for(uint64_t i = 0; i < count; i++) {
+            __atomic_store_n(&events[(slot + i) % header->capacity].op, Trace::None, __ATOMIC_RELAXED);
+        }
+        slot = header->next.fetch_add(count, std::memory_order_relaxed);
+    }
+    return &events[slot % header->capacity];
+}
+
+static void fill(Trace::Event& event, Trace::Op op, void* object, size_t size) {
+    event.object = reinterpret_cast<uintptr_t>(object);
+    event.size = size < UINT32_MAX ? static_cast<uint32_t>(size) : UINT32_MAX;
+    event.thread = t_thread;
+    event.reserved = 0;
+    __atomic_store_n(&event.op, op, __ATOMIC_RELEASE);
+}
+
+void Trace::record(Op op, void* object, size_t size) {
+    Event* event = claim(1);
+    if(event != nullptr) {
+        fill(*event, op, object, size);
+    }
+}
+
+void Trace::recordRealloc(void* from, void* to, size_t size) {
+    Event* event = claim(2);
+    if(event != nullptr) {
+        fill(event[0], ReallocFrom, from, 0);
+        fill(event[1], ReallocTo, to, size);
+    }
+}
+
+Trace::Reader::Reader() : m_map(nullptr), m_mapSize(0), m_events(nullptr), m_capacity(0), m_next(0) {
+}
+
+Trace::Reader::~Reader() {
+    if(m_map != nullptr) {
+        munmap(m_map, m_mapSize);
+    }
+}
+
+bool Trace::Reader::open(const char* path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    void* map = size >= static_cast<off_t>(sizeof(Header))
+        ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(map == MAP_FAILED) {
+        return false;
+    }
+
+    const Header* header = static_cast<const Header*>(map);
+    if(memcmp(header->magic, magic, sizeof(magic)) != 0 || header->capacity == 0
+            || sizeof(Header) + header->capacity * sizeof(Event) > static_cast<size_t>(size)) {
+        munmap(map, size);
+        return false;
+    }
+    m_map = map;
+    m_mapSize = size;
+    m_events = reinterpret_cast<const Event*>(header + 1);
+    m_capacity = header->capacity;
+    m_next = header->next.load(std::memory_order_relaxed);
+    return true;
+}
@@ -1,10 +1,24 @@
+#include <HeapProfiler.hpp>
 #include <Malloc.hpp>
+#include <ObjectPool.hpp>
+#include <PageReserve.hpp>
+#include <Region.hpp>
+#include <Trace.hpp>
 #include <TestSuite.hpp>
 #include <Assert.hpp>
 #include <TestSuite.hpp>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <list>
+#include <map>
 #include <thread>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <iostream>
 
 size_t expectedArenaAllocations(size_t blockSize) {
@@ -105,6 +119,24 @@ void canAllocateBigObject() {
     ASSERT_EQ(MMapObject::outstandingPages(), 0);
 }
 
+void oversizedRequestsFail() {
+    // Sizes that would wrap around once the header, canary and page rounding
+    // are added, and ones no mmap could give us.
+    for (size_t size : { SIZE_MAX, SIZE_MAX - 8, SIZE_MAX - 4096, MMapObject::maxSize }) {
+        errno = 0;
+        ASSERT_TRUE(myMalloc(size) == nullptr);
+        ASSERT_EQ(errno, ENOMEM);
+        errno = 0;
+        ASSERT_TRUE(myCalloc(1, size) == nullptr);
+        ASSERT_EQ(errno, ENOMEM);
+        ASSERT_TRUE(BigAlloc::alloc(size) == nullptr);
+    }
+    errno = 0;
+    ASSERT_TRUE(myCalloc(1, SIZE_MAX - 16) == nullptr);
+    ASSERT_EQ(errno, ENOMEM);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
 void mmapObjectHasCorrectSize() {
     auto data = BigAlloc::alloc(1234);
 
@@ -112,7 +144,7 @@ void mmapObjectHasCorrectSize() {
 
     auto mmapObjectPtr = reinterpret_cast<MMapObject*>(((char*)data - sizeof(BigAlloc)));
 
-    ASSERT_EQ(mmapObjectPtr->mmapSize(), 1234 + sizeof(BigAlloc));
+    ASSERT_EQ(mmapObjectPtr->mmapSize(), 1234 + sizeof(BigAlloc) + BigAlloc::canaryBytes);
     ASSERT_EQ(mmapObjectPtr->arenaSize(), 0);
     ASSERT_TRUE(data != mmapObjectPtr);
 
@@ -170,18 +202,19 @@ void canFreeCorrectNumberOfBlocks() {
         size_t numAllocs = 0;
 
         size_t expectedAllocations = expectedArenaAllocations(arenaSize);
+        std::vector<void*> ptrs;
 
         for (size_t i = 0; i < expectedAllocations; i++) {
-            void* ptr = arena->alloc();
+            ptrs.push_back(arena->alloc());
         }
 
         ASSERT_TRUE(arena->full());
 
         for (size_t i = 0; i < expectedAllocations - 1; i++) {
-            ASSERT_TRUE(!arena->free());
+            ASSERT_TRUE(!arena->free(ptrs[i]));
         }
 
-        ASSERT_TRUE(arena->free());
+        ASSERT_TRUE(arena->free(ptrs.back()));
 
         MMapObject::dealloc(arena);
     }
@@ -189,6 +222,1357 @@ void canFreeCorrectNumberOfBlocks() {
     ASSERT_EQ(MMapObject::outstandingPages(), 0);
 }
 
+void arenaReusesFreedSlots() {
+    Arena* arena = Arena::create(32);
+    size_t expectedAllocations = expectedArenaAllocations(32);
+    std::vector<void*> ptrs;
+
+    while (!arena->full()) {
+        ptrs.push_back(arena->alloc());
+    }
+
+    // Freeing any slot makes room for exactly that slot again.
+    ASSERT_TRUE(!arena->free(ptrs[3]));
+    ASSERT_TRUE(!arena->full());
+    ASSERT_TRUE(arena->alloc() == ptrs[3]);
+    ASSERT_TRUE(arena->full());
+
+    // Slots come back most-recently-freed first.
+    ASSERT_TRUE(!arena->free(ptrs[5]));
+    ASSERT_TRUE(!arena->free(ptrs[9]));
+    ASSERT_TRUE(arena->alloc() == ptrs[9]);
+    ASSERT_TRUE(arena->alloc() == ptrs[5]);
+    ASSERT_EQ(ptrs.size(), expectedAllocations);
+
+    MMapObject::dealloc(arena);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void remoteFreesAreCollectedInOneBatch() {
+    Arena* arena = Arena::create(64);
+    std::vector<void*> ptrs;
+
+    while (!arena->full()) {
+        ptrs.push_back(arena->alloc());
+    }
+
+    ASSERT_TRUE(arena->retire());
+
+    // Only the first remote free into a retired arena reports it.
+    ASSERT_TRUE(arena->remoteFree(ptrs[0]));
+    ASSERT_TRUE(!arena->remoteFree(ptrs[1]));
+    ASSERT_TRUE(!arena->remoteFree(ptrs[2]));
+
+    // The remote free already took the arena out of retirement.
+    ASSERT_TRUE(!arena->reclaim());
+    ASSERT_TRUE(arena->full());
+    ASSERT_TRUE(!arena->collectRemote());
+    ASSERT_TRUE(!arena->full());
+
+    ASSERT_TRUE(arena->alloc() == ptrs[2]);
+    ASSERT_TRUE(arena->alloc() == ptrs[1]);
+    ASSERT_TRUE(arena->alloc() == ptrs[0]);
+    ASSERT_TRUE(arena->full());
+
+    // alloc() collects remote frees by itself once the local slots run out.
+    ASSERT_TRUE(!arena->remoteFree(ptrs[7]));
+    ASSERT_TRUE(arena->alloc() == ptrs[7]);
+
+    MMapObject::dealloc(arena);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void slotBitmapTracksLiveItems() {
+    Arena* arena = Arena::create(64, nullptr, 3);
+    std::vector<void*> ptrs;
+    for (size_t i = 0; i < 100; i++) {
+        ptrs.push_back(arena->alloc());
+        ASSERT_EQ(arena->slotOf(ptrs.back()), i);
+    }
+    ASSERT_EQ(arena->liveCount(), 100);
+
+    // Local frees clear their bits at once, remote ones once collected.
+    for (size_t i = 0; i < 100; i += 3) {
+        arena->free(ptrs[i]);
+    }
+    ASSERT_TRUE(!arena->remoteFree(ptrs[1]));
+    ASSERT_TRUE(!arena->live(0));
+    ASSERT_TRUE(arena->live(1));
+    ASSERT_EQ(arena->liveCount(), 66);
+    std::vector<void*> live;
+    arena->forEachLive([&](void* item) { live.push_back(item); });
+    ASSERT_EQ(live.size(), 66);
+    ASSERT_TRUE(live[0] == ptrs[1]);
+    ASSERT_TRUE(live[1] == ptrs[2]);
+    arena->collectRemote();
+    ASSERT_TRUE(!arena->live(1));
+
+    // A batch that takes every free slot finds them in the bitmap, in order.
+    void* out[64];
+    ASSERT_EQ(arena->allocBatch(out, 64), 64);
+    ASSERT_TRUE(out[0] == ptrs[0]);
+    ASSERT_TRUE(out[1] == ptrs[1]);
+    ASSERT_TRUE(out[2] == ptrs[3]);
+    ASSERT_TRUE(out[34] == ptrs[99]);
+    // The rest came off the bump region.
+    ASSERT_TRUE(out[35] == arena->slot(100));
+    ASSERT_EQ(arena->liveCount(), 129);
+
+    MMapObject::dealloc(arena);
+}
+
+void sizeClassIsSmallestFit() {
+    for (size_t n = 0; n <= SizeClass::maxSize; n++) {
+        size_t sizeClass = SizeClass::index(n);
+
+        ASSERT_TRUE(sizeClass < SizeClass::count);
+        ASSERT_TRUE(SizeClass::size(sizeClass) >= n);
+        ASSERT_TRUE(sizeClass == 0 || SizeClass::size(sizeClass - 1) < n);
+    }
+
+    for (size_t i = 0; i < SizeClass::count; i++) {
+        ASSERT_EQ(SizeClass::slotsPerPage(i), expectedArenaAllocations(SizeClass::size(i)));
+    }
+}
+
+void largeClassesSpanMultiplePages() {
+    for (size_t i = 0; i < SizeClass::count; i++) {
+        size_t pages = SizeClass::spanPages(i);
+        size_t spanBytes = pages * pageSize;
+        size_t used = SizeClass::slotsPerSpan(i) * SizeClass::size(i);
+
+        ASSERT_TRUE(pages >= 1 && pages <= maxSpanPages);
+        ASSERT_TRUE(used + sizeof(Arena) <= spanBytes);
+        ASSERT_TRUE(SizeClass::slotsPerSpan(i) >= SizeClass::slotsPerPage(i));
+    }
+
+    // With the default classes a 1024 byte arena holds far more than 3 items.
+    size_t largest = SizeClass::count - 1;
+    std::vector<void*> ptrs;
+
+    for (size_t i = 0; i < SizeClass::slotsPerSpan(largest); i++) {
+        ptrs.push_back(myMalloc(SizeClass::maxSize));
+    }
+
+    auto arena = static_cast<Arena*>(MMapObject::fromPointer(ptrs.back()));
+
+    ASSERT_EQ(arena->mmapSize(), SizeClass::spanPages(largest) * pageSize);
+    ASSERT_EQ(arena->arenaSize(), SizeClass::maxSize);
+
+    // Items past the first page still find their header.
+    for (auto ptr : ptrs) {
+        auto itemArena = MMapObject::fromPointer(ptr);
+
+        ASSERT_TRUE((char*)ptr >= (char*)itemArena + sizeof(Arena));
+        ASSERT_TRUE((char*)ptr + SizeClass::maxSize <= (char*)itemArena + itemArena->mmapSize());
+
+        myFree(ptr);
+    }
+
+    myMallocCollect();
+}
+
+/**
+ * A policy of a few one page classes and no counters, for a store of its own.
+ */
+struct TinyPolicy : MallocPolicy {
+    static constexpr size_t sizes[] = { 16, 64, 256 };
+    static constexpr size_t maxSpanPages = 1;
+    static constexpr size_t emptyArenaCache = 1;
+    static constexpr bool stats = false;
+};
+
+void storesFollowTheirPolicy() {
+    using TinyClasses = BasicArenaStore<TinyPolicy>::SizeClass;
+    ASSERT_EQ(TinyClasses::count, 3);
+    ASSERT_EQ(TinyClasses::maxSize, 256);
+    ASSERT_EQ(TinyClasses::size(TinyClasses::index(17)), 64);
+    for (size_t i = 0; i < TinyClasses::count; i++) {
+        ASSERT_EQ(TinyClasses::spanPages(i), 1);
+    }
+    ASSERT_EQ(BasicArenaStore<TinyPolicy>::emptyArenaCacheSize, 1);
+
+    size_t pages = MMapObject::outstandingPages();
+    auto store = new BasicArenaStore<TinyPolicy>();
+
+    // Requests are served from the policy's classes, and anything over its
+    // largest is a BigAlloc.
+    void* small = store->alloc(20);
+    void* big = store->alloc(300);
+    ASSERT_EQ(myMallocUsableSize(small), 64);
+    ASSERT_TRUE(PageMap::lookup(small)->owner == store);
+    ASSERT_EQ(PageMap::lookup(big)->arenaSize, 0);
+
+    // Counters that are compiled out stay at zero; arenas are still counted.
+    ASSERT_EQ(store->stats().classes[1].allocs.load(), 0);
+    ASSERT_EQ(store->stats().classes[1].arenasCreated.load(), 1);
+
+    store->free(small);
+    store->free(big);
+    store->collect();
+    ASSERT_EQ(MMapObject::outstandingPages(), pages);
+    delete store;
+}
+
+void pageMapFindsEverySpan() {
+    Arena* arena = Arena::create(64, nullptr, 3);
+    char* base = reinterpret_cast<char*>(arena);
+
+    // Every page of an arena maps back to its header.
+    for (size_t offset = 0; offset < 3 * pageSize; offset += pageSize / 2) {
+        const PageMap::Entry* entry = PageMap::lookup(base + offset);
+
+        ASSERT_TRUE(entry != nullptr);
+        ASSERT_TRUE(entry->span == arena);
+        ASSERT_EQ(entry->arenaSize, 64);
+        ASSERT_TRUE(entry->owner == nullptr);
+    }
+
+    ASSERT_TRUE(PageMap::lookup(base + 3 * pageSize) == nullptr);
+
+    void* data = BigAlloc::alloc(3 * pageSize);
+    const PageMap::Entry* entry = PageMap::lookup(data);
+
+    ASSERT_TRUE(entry != nullptr);
+    ASSERT_EQ(entry->arenaSize, 0);
+    ASSERT_TRUE(MMapObject::fromPointer(data) == entry->span);
+
+    MMapObject::dealloc(data);
+    MMapObject::dealloc(arena);
+
+    // Freed spans are forgotten.
+    ASSERT_TRUE(PageMap::lookup(data) == nullptr);
+    ASSERT_TRUE(PageMap::lookup(base + pageSize) == nullptr);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void arenasComeFromTheReservation() {
+    Arena* arena = Arena::create(128, nullptr, 2);
+
+    ASSERT_TRUE(PageReserve::contains(arena));
+    ASSERT_TRUE(PageReserve::committedPages() >= 2);
+
+    // A freed span is reused for the next arena of that size without a syscall.
+    arena->alloc();
+    MMapObject::dealloc(arena);
+
+    size_t syscalls = PageReserve::syscalls();
+    Arena* again = Arena::create(128, nullptr, 2);
+
+    ASSERT_TRUE(again == arena);
+    ASSERT_EQ(PageReserve::syscalls(), syscalls);
+
+    // Decommitted spans are still reusable, and come back zeroed.
+    volatile char* data = static_cast<volatile char*>(again->alloc());
+    *data = 0x5A;
+    MMapObject::dealloc(again);
+    PageReserve::decommit();
+
+    ASSERT_EQ(PageReserve::dirtyPages(), 0);
+
+    Arena* clean = Arena::create(128, nullptr, 2);
+
+    ASSERT_TRUE(clean == arena);
+    ASSERT_EQ(*data, 0);
+
+    MMapObject::dealloc(clean);
+
+    // Big allocations are still mapped on their own.
+    void* big = BigAlloc::alloc(maxMediumPages * pageSize);
+
+    ASSERT_TRUE(!PageReserve::contains(big));
+
+    MMapObject::dealloc(big);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void emptyArenasAreCachedForReuse() {
+    size_t sizeClass = SizeClass::index(48);
+    size_t count = SizeClass::slotsPerSpan(sizeClass);
+    std::vector<void*> ptrs;
+
+    // Fill two arenas so the first one is retired, then empty it.
+    for (size_t i = 0; i < 2 * count; i++) {
+        ptrs.push_back(myMalloc(48));
+    }
+
+    Arena* first = static_cast<Arena*>(MMapObject::fromPointer(ptrs.front()));
+    size_t pages = MMapObject::outstandingPages();
+
+    for (size_t i = 0; i < count; i++) {
+        myFree(ptrs[i]);
+    }
+
+    // The empty arena stays mapped...
+    ASSERT_EQ(MMapObject::outstandingPages(), pages);
+
+    // ...and is handed out again once the current arena fills up.
+    std::vector<void*> more;
+
+    for (size_t i = 0; i < count; i++) {
+        more.push_back(myMalloc(48));
+    }
+
+    bool reused = false;
+
+    for (auto ptr : more) {
+        reused = reused || MMapObject::fromPointer(ptr) == first;
+    }
+
+    ASSERT_TRUE(reused);
+    ASSERT_EQ(MMapObject::outstandingPages(), pages);
+
+    for (size_t i = count; i < ptrs.size(); i++) {
+        myFree(ptrs[i]);
+    }
+
+    for (auto ptr : more) {
+        myFree(ptr);
+    }
+
+    // Collecting releases the cache.
+    myMallocCollect();
+
+    ASSERT_TRUE(MMapObject::outstandingPages() < pages);
+}
+
+void spansGoBackToTheirNode() {
+    void* span = PageReserve::allocSpan(3);
+    size_t node = PageReserve::node(span);
+
+    ASSERT_TRUE(PageReserve::nodes() >= 1);
+    ASSERT_TRUE(PageReserve::nodes() <= PageReserve::maxNodes);
+    ASSERT_TRUE(node < PageReserve::nodes());
+
+    // Whoever frees it, a span lands back on its own node's lists.
+    std::thread([span] { PageReserve::freeSpan(span, 3); }).join();
+    if (PageReserve::nodes() == 1) {
+        ASSERT_TRUE(PageReserve::allocSpan(3) == span);
+        PageReserve::freeSpan(span, 3);
+    }
+}
+
+void zeroSpansReadAsZero() {
+    // A span that was written and freed comes back dirty...
+    char* span = static_cast<char*>(PageReserve::allocSpan(7));
+    memset(span, 0x5A, 7 * pageSize);
+    PageReserve::freeSpan(span, 7);
+
+    bool zero = true;
+    char* again = static_cast<char*>(PageReserve::allocSpan(7, &zero));
+
+    if (PageReserve::nodes() == 1) {
+        ASSERT_TRUE(again == span);
+        ASSERT_TRUE(!zero);
+    }
+    PageReserve::freeSpan(again, 7);
+
+    // ...but once it's decommitted it's known to be zero again, like the
+    // pages the reserve hasn't handed out yet.
+    PageReserve::decommit();
+    std::vector<char*> spans;
+    bool sawZero = false;
+
+    while (!sawZero && spans.size() < 64) {
+        spans.push_back(static_cast<char*>(PageReserve::allocSpan(7, &zero)));
+        sawZero = zero;
+    }
+
+    ASSERT_TRUE(sawZero);
+    for (size_t i = 0; i < 7 * pageSize; i++) {
+        ASSERT_EQ(spans.back()[i], 0);
+    }
+
+    for (char* s : spans) {
+        PageReserve::freeSpan(s, 7);
+    }
+}
+
+void mediumAllocationsReuseFreedRegions() {
+    void* data = BigAlloc::alloc(5000);
+
+    ASSERT_TRUE(PageReserve::contains(data));
+
+    MMapObject::dealloc(data);
+
+    // A freed region comes back for the next request with the same page count.
+    size_t syscalls = PageReserve::syscalls();
+    void* again = BigAlloc::alloc(6000);
+
+    ASSERT_TRUE(again == data);
+    ASSERT_EQ(PageReserve::syscalls(), syscalls);
+    ASSERT_EQ(BigAlloc::size(again), 2 * pageSize - sizeof(BigAlloc) - BigAlloc::canaryBytes);
+
+    MMapObject::dealloc(again);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void reallocKeepsContents() {
+    // Growing within a slot doesn't move.
+    auto small = (char*)myMalloc(20);
+    ASSERT_TRUE(myRealloc(small, SizeClass::size(SizeClass::index(20))) == small);
+
+    for (size_t i = 0; i < 20; i++) {
+        small[i] = static_cast<char>(i);
+    }
+
+    // Growing past it copies into a bigger class, then into a BigAlloc.
+    auto grown = (char*)myRealloc(small, 500);
+    grown = (char*)myRealloc(grown, 20000);
+
+    for (size_t i = 0; i < 20; i++) {
+        ASSERT_EQ(grown[i], static_cast<char>(i));
+    }
+
+    // Big blocks grow with mremap, keeping the page count at one.
+    constexpr size_t bigSize = 1 << 20;
+    auto big = (char*)myMalloc(bigSize);
+    big[0] = 1;
+    big[bigSize - 1] = 2;
+
+    size_t pages = MMapObject::outstandingPages();
+    big = (char*)myRealloc(big, 64 * bigSize);
+
+    ASSERT_TRUE(big != nullptr);
+    ASSERT_EQ(MMapObject::outstandingPages(), pages);
+    ASSERT_EQ(big[0], 1);
+    ASSERT_EQ(big[bigSize - 1], 2);
+    ASSERT_TRUE(BigAlloc::size(big) >= 64 * bigSize);
+
+    big[64 * bigSize - 1] = 3;
+
+    // Sizes that would wrap fail, and leave the block as it was.
+    for (size_t size : { SIZE_MAX, SIZE_MAX - 8, MMapObject::maxSize }) {
+        errno = 0;
+        ASSERT_TRUE(myRealloc(big, size) == nullptr);
+        ASSERT_EQ(errno, ENOMEM);
+        ASSERT_TRUE(myRealloc(grown, size) == nullptr);
+    }
+    ASSERT_EQ(big[64 * bigSize - 1], 3);
+    ASSERT_TRUE(BigAlloc::size(big) >= 64 * bigSize);
+
+    ASSERT_TRUE(myRealloc(big, 0) == nullptr);
+    myFree(grown);
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void callocClearsRecycledMemory() {
+    for (size_t size : { (size_t)100, (size_t)5000, (size_t)1 << 20 }) {
+        auto dirty = (char*)myMalloc(size);
+        memset(dirty, 0xff, size);
+        myFree(dirty);
+
+        auto zeroed = (char*)myCalloc(1, size);
+        for (size_t i = 0; i < size; i++) {
+            ASSERT_EQ(zeroed[i], 0);
+        }
+        myFree(zeroed);
+    }
+
+    // Slots bumped off a fresh arena aren't cleared, but still read as zero.
+    PageReserve::decommit();
+    std::vector<char*> ptrs;
+
+    for (size_t i = 0; i < 2 * SizeClass::slotsPerSpan(SizeClass::index(320)); i++) {
+        ptrs.push_back((char*)myCalloc(32, 10));
+        for (size_t j = 0; j < 320; j++) {
+            ASSERT_EQ(ptrs.back()[j], 0);
+        }
+        memset(ptrs.back(), 0xff, 320);
+    }
+
+    for (auto ptr : ptrs) {
+        myFree(ptr);
+    }
+
+    ASSERT_TRUE(myCalloc((size_t)1 << 40, (size_t)1 << 40) == nullptr);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void alignedAllocationsAreAligned() {
+    for (size_t alignment = 8; alignment <= 16 * pageSize; alignment *= 2) {
+        for (size_t size : { (size_t)24, (size_t)3000, (size_t)100000 }) {
+            auto ptr = (char*)myAlignedAlloc(alignment, size);
+
+            ASSERT_TRUE(ptr != nullptr);
+            ASSERT_EQ((uintptr_t)ptr % alignment, 0);
+            ASSERT_TRUE(myMallocUsableSize(ptr) >= size);
+
+            ptr[0] = 1;
+            ptr[size - 1] = 2;
+
+            // Aligned blocks can still be resized; they're just copied.
+            ptr = (char*)myRealloc(ptr, 2 * size);
+            ASSERT_EQ(ptr[0], 1);
+            ASSERT_EQ(ptr[size - 1], 2);
+            myFree(ptr);
+        }
+    }
+
+    // Oversized requests fail rather than wrapping, at any alignment.
+    for (size_t alignment = 16; alignment <= 16 * pageSize; alignment *= 2) {
+        for (size_t size : { SIZE_MAX, SIZE_MAX - 4096, MMapObject::maxSize }) {
+            errno = 0;
+            ASSERT_TRUE(myAlignedAlloc(alignment, size) == nullptr);
+            ASSERT_EQ(errno, ENOMEM);
+        }
+    }
+    ASSERT_TRUE(myAlignedAlloc(size_t(1) << 62, 10) == nullptr);
+
+    void* ptr = nullptr;
+    ASSERT_EQ(myPosixMemalign(&ptr, SIZE_MAX / 2 + 1, SIZE_MAX - 4096), ENOMEM);
+    ASSERT_EQ(myPosixMemalign(&ptr, 0, 10), EINVAL);
+    ASSERT_EQ(myPosixMemalign(&ptr, 4, 10), EINVAL);
+    ASSERT_EQ(myPosixMemalign(&ptr, 24, 10), EINVAL);
+    ASSERT_EQ(myPosixMemalign(&ptr, 64, 10), 0);
+    ASSERT_EQ((uintptr_t)ptr % 64, 0);
+    myFree(ptr);
+
+    ASSERT_EQ(myMallocUsableSize(nullptr), 0);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void sizedFreesFindTheirArena() {
+    constexpr size_t count = 100;
+    void* small[count];
+    void* big = myMalloc(5000);
+
+    for (size_t i = 0; i < count; i++) {
+        small[i] = myMalloc(40);
+    }
+
+    // Sized frees into the current arena and everywhere else both land.
+    myFreeSized(big, 5000);
+    for (size_t i = 0; i < count; i++) {
+        myFreeSized(small[i], 40);
+    }
+    myFreeSized(nullptr, 40);
+
+    // The slots are back on the current arena's free list.
+    void* again = myMalloc(40);
+    ASSERT_TRUE(again == small[count - 1]);
+    myFreeSized(again, 40);
+
+    // Another thread's frees still go back to their owner.
+    void* remote = myMalloc(40);
+    std::thread([remote] { myFreeSized(remote, 40); }).join();
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void batchesFillWholeArenas() {
+    constexpr size_t count = 300;
+    void* ptrs[count];
+    size_t perArena = SizeClass::slotsPerSpan(SizeClass::index(48));
+
+    ASSERT_EQ(myMallocBatch(48, count, ptrs), count);
+
+    // A fresh arena's slots come out as one contiguous run.
+    for (size_t i = 1; i < perArena; i++) {
+        ASSERT_EQ((char*)ptrs[i] - (char*)ptrs[i - 1], 48);
+    }
+    ASSERT_EQ(MMapObject::outstandingPages(), (count + perArena - 1) / perArena);
+
+    for (size_t i = 0; i < count; i++) {
+        memset(ptrs[i], (int)i, 48);
+    }
+
+    // Half go back from another thread, the rest from here.
+    std::thread([&ptrs] { myFreeBatch(ptrs, count / 2); }).join();
+    myFreeBatch(ptrs + count / 2, count - count / 2);
+
+    // Freed slots are reused first.
+    void* again[2];
+    ASSERT_EQ(myMallocBatch(48, 2, again), 2);
+    ASSERT_TRUE(again[0] != again[1]);
+    myFreeBatch(again, 2);
+
+    void* big[3] = { nullptr, nullptr, nullptr };
+    ASSERT_EQ(myMallocBatch(5000, 2, big), 2);
+    myFreeBatch(big, 3);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void regionsBumpAndResetAtOnce() {
+    {
+        Region region;
+        auto first = (char*)region.alloc(10);
+        auto second = (char*)region.alloc(100, 64);
+
+        ASSERT_EQ((uintptr_t)first % alignof(max_align_t), 0);
+        ASSERT_EQ((uintptr_t)second % 64, 0);
+        ASSERT_TRUE(second >= first + 10);
+        ASSERT_TRUE(second < first + 10 + 64);
+        ASSERT_EQ(MMapObject::outstandingPages(), 1);
+
+        // Big requests get their own chunk, and don't end the current one.
+        void* big = region.alloc(Region::chunkSize);
+        ASSERT_TRUE(big != nullptr);
+        auto third = (char*)region.alloc(10, 4);
+        ASSERT_TRUE(third == second + 100);
+        ASSERT_EQ(MMapObject::outstandingPages(), 2);
+
+        for (size_t i = 0; i < 10000; i++) {
+            memset(region.alloc(24), 0, 24);
+        }
+        ASSERT_TRUE(MMapObject::outstandingPages() > 2);
+
+        // Reset keeps just the current chunk.
+        region.reset();
+        ASSERT_EQ(MMapObject::outstandingPages(), 1);
+        ASSERT_TRUE(region.alloc(24) != nullptr);
+
+        RegionResource resource(region);
+        std::pmr::vector<int> vector(&resource);
+        for (int i = 0; i < 10000; i++) {
+            vector.push_back(i);
+        }
+        ASSERT_EQ(vector[9999], 9999);
+
+        // Requests too big to map fail rather than wrapping around, and the
+        // resource turns that into std::bad_alloc.
+        size_t before = MMapObject::outstandingPages();
+        ASSERT_TRUE(region.alloc(SIZE_MAX - 16) == nullptr);
+        ASSERT_TRUE(region.alloc(SIZE_MAX / 2, size_t(1) << 62) == nullptr);
+        ASSERT_TRUE(region.alloc(MMapObject::maxSize) == nullptr);
+        bool threw = false;
+        try {
+            resource.allocate(SIZE_MAX - 16, 16);
+        }
+        catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        ASSERT_TRUE(threw);
+        ASSERT_EQ(MMapObject::outstandingPages(), before);
+        ASSERT_TRUE(region.alloc(24) != nullptr);
+    }
+
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+struct PoolNode {
+    PoolNode* next;
+    long double value;
+
+    PoolNode(long double value) : next(nullptr), value(value) {
+    }
+};
+
+void objectPoolsRecycleSlots() {
+    {
+        ObjectPool<PoolNode> pool;
+        constexpr size_t count = 1000;
+        PoolNode* nodes[count];
+
+        for (size_t i = 0; i < count; i++) {
+            nodes[i] = pool.create(i);
+            ASSERT_EQ((uintptr_t)nodes[i] % alignof(PoolNode), 0);
+        }
+        ASSERT_EQ(pool.live(), count);
+
+        // Slots are handed out back to back, and freed ones come back first.
+        ASSERT_EQ((char*)nodes[1] - (char*)nodes[0], ObjectPool<PoolNode>::slotSize);
+        pool.destroy(nodes[10]);
+        ASSERT_TRUE(pool.create(5) == nodes[10]);
+
+        for (size_t i = 0; i < count; i++) {
+            ASSERT_EQ(nodes[i]->value, i == 10 ? 5 : i);
+            pool.destroy(nodes[i]);
+        }
+        ASSERT_EQ(pool.live(), 0);
+        ASSERT_TRUE(MMapObject::outstandingPages() > 1);
+    }
+
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+
+    // Node containers get their nodes from the thread's pools.
+    std::thread([] {
+        std::list<int, PoolAllocator<int>> list;
+        std::map<int, int, std::less<int>, PoolAllocator<std::pair<const int, int>>> map;
+        for (int i = 0; i < 1000; i++) {
+            list.push_back(i);
+            map[i] = i;
+        }
+        ASSERT_EQ(list.back(), 999);
+        ASSERT_EQ(map[500], 500);
+    }).join();
+
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void cacheAlignedAllocationsDontShareLines() {
+    constexpr size_t count = 100;
+    char* ptrs[count];
+
+    // Arena slots of any class that's a multiple of a line start on one.
+    ASSERT_EQ(sizeof(Arena) % cacheLineSize, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        ptrs[i] = (char*)myMallocCacheAligned(i % 3 == 0 ? 8 : 70);
+        ASSERT_EQ((uintptr_t)ptrs[i] % cacheLineSize, 0);
+        ASSERT_EQ(myMallocUsableSize(ptrs[i]) % cacheLineSize, 0);
+    }
+
+    // Nothing else lands on the lines they use.
+    auto other = (char*)myMalloc(8);
+    for (size_t i = 0; i < count; i++) {
+        size_t lines = myMallocUsableSize(ptrs[i]) / cacheLineSize;
+        ASSERT_TRUE(other < ptrs[i] || other >= ptrs[i] + lines * cacheLineSize);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        myFree(ptrs[i]);
+    }
+    myFree(other);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void statsCountEveryAllocation() {
+    constexpr size_t count = 50;
+    size_t idx = SizeClass::index(48);
+    MallocStats before = myMallocStats();
+
+    void* ptrs[count];
+    for (size_t i = 0; i < count; i++) {
+        ptrs[i] = myMalloc(36);
+    }
+    MallocStats during = myMallocStats();
+    ASSERT_EQ(during.classes[idx].allocs - before.classes[idx].allocs, count);
+    ASSERT_EQ(during.classes[idx].bytesRequested - before.classes[idx].bytesRequested, count * 36);
+    ASSERT_EQ(during.classes[idx].liveSlots - before.classes[idx].liveSlots, count);
+    ASSERT_TRUE(during.classes[idx].bytesReserved >= during.classes[idx].liveSlots * 48);
+
+    // A free from another thread counts as one for the class, and as a remote one.
+    void* remote = ptrs[0];
+    std::thread([remote] { myFree(remote); }).join();
+    for (size_t i = 1; i < count; i++) {
+        myFree(ptrs[i]);
+    }
+    MallocStats after = myMallocStats();
+    ASSERT_EQ(after.classes[idx].frees - before.classes[idx].frees, count);
+    ASSERT_EQ(after.classes[idx].crossThreadFrees - before.classes[idx].crossThreadFrees, 1);
+    ASSERT_EQ(after.classes[idx].liveSlots, before.classes[idx].liveSlots);
+    // The other thread's store may have been one an earlier thread left.
+    ASSERT_TRUE(after.threads >= 2);
+
+    void* big = myMalloc(3 * pageSize);
+    ASSERT_EQ(myMallocStats().bigAllocs - after.bigAllocs, 1);
+    myFree(big);
+    ASSERT_EQ(myMallocStats().bigBytesLive, after.bigBytesLive);
+
+    // Aligned BigAllocs, padded out or not, are counted as they're made too.
+    void* aligned[] = { myAlignedAlloc(pageSize, 100), myAlignedAlloc(16, 5000), myAlignedAlloc(64, 1 << 20) };
+    MallocStats alignedDuring = myMallocStats();
+    ASSERT_EQ(alignedDuring.bigAllocs - after.bigAllocs, 4);
+    ASSERT_TRUE(alignedDuring.bigBytesLive > after.bigBytesLive + (1 << 20));
+    for (void* ptr : aligned) {
+        myFree(ptr);
+    }
+    MallocStats alignedAfter = myMallocStats();
+    ASSERT_EQ(alignedAfter.bigAllocs - alignedAfter.bigFrees, after.bigAllocs - after.bigFrees);
+    ASSERT_EQ(alignedAfter.bigBytesLive, after.bigBytesLive);
+
+    // Growing and shrinking a BigAlloc, in place or not, counts the change in
+    // its size.
+    big = myMalloc(200 << 10);
+    big = myRealloc(big, 4 << 20);
+    MallocStats grown = myMallocStats();
+    ASSERT_TRUE(BigAlloc::size(big) >= 4 << 20);
+    ASSERT_EQ(grown.bigBytesLive - alignedAfter.bigBytesLive, BigAlloc::size(big));
+    big = myRealloc(big, 300 << 10);
+    MallocStats shrunk = myMallocStats();
+    ASSERT_EQ(shrunk.bigBytesLive - alignedAfter.bigBytesLive, BigAlloc::size(big));
+    ASSERT_TRUE(shrunk.bytesReserved < grown.bytesReserved);
+    myFree(big);
+    MallocStats reallocAfter = myMallocStats();
+    ASSERT_EQ(reallocAfter.bigAllocs - reallocAfter.bigFrees, alignedAfter.bigAllocs - alignedAfter.bigFrees);
+    ASSERT_EQ(reallocAfter.bigBytesLive, alignedAfter.bigBytesLive);
+
+    // The preloaded malloc() rounds up to a 16 byte aligned class, but counts
+    // what was asked for.
+    size_t aligned32 = SizeClass::index(32);
+    void* rounded = myMallocMaxAligned(24);
+    auto zeroed = (char*)myCallocMaxAligned(3, 8);
+    MallocStats roundedDuring = myMallocStats();
+    ASSERT_EQ((uintptr_t)rounded % alignof(max_align_t), 0);
+    ASSERT_EQ((uintptr_t)zeroed % alignof(max_align_t), 0);
+    ASSERT_EQ(myMallocUsableSize(rounded), 32);
+    for (size_t i = 0; i < 24; i++) {
+        ASSERT_EQ(zeroed[i], 0);
+    }
+    ASSERT_EQ(roundedDuring.classes[aligned32].allocs - alignedAfter.classes[aligned32].allocs, 2);
+    ASSERT_EQ(roundedDuring.classes[aligned32].bytesRequested - alignedAfter.classes[aligned32].bytesRequested, 48);
+    myFree(rounded);
+    myFree(zeroed);
+
+    // Both dumps fit in a page and name the class; a short buffer still gets
+    // the whole length back.
+    char buffer[16 * pageSize];
+    size_t length = myMallocStatsDump(buffer, sizeof(buffer), false);
+    ASSERT_TRUE(length < sizeof(buffer));
+    ASSERT_TRUE(strstr(buffer, "    48 ") != nullptr);
+    length = myMallocStatsDump(buffer, sizeof(buffer), true);
+    ASSERT_TRUE(length < sizeof(buffer));
+    ASSERT_EQ(buffer[0], '{');
+    ASSERT_TRUE(strstr(buffer, "{\"size\":48,") != nullptr);
+    char tiny[8];
+    ASSERT_EQ(myMallocStatsDump(tiny, sizeof(tiny), true), length);
+    ASSERT_EQ(strlen(tiny), sizeof(tiny) - 1);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void heapProfileSamplesAllocations() {
+    constexpr size_t count = 2000;
+    size_t before = HeapProfiler::samples();
+    myMallocSetSampleRate(4 * 1024);
+
+    // 128000 bytes at one sample per 4k or so.
+    void* ptrs[count];
+    for (size_t i = 0; i < count; i++) {
+        ptrs[i] = myMalloc(64);
+        memset(ptrs[i], (int)i, 64);
+    }
+    size_t sampled = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (HeapProfiler::sampled(ptrs[i])) {
+            // Out of the arenas, but still aligned like a slot.
+            ASSERT_EQ(PageMap::lookup(ptrs[i])->arenaSize, 0);
+            ASSERT_EQ((uintptr_t)ptrs[i] % 64, 0);
+            ASSERT_EQ((uintptr_t)ptrs[i] % pageSize, sizeof(Arena));
+            // Marked in the header, so unsampled frees needn't ask the profiler.
+            ASSERT_EQ(BigAlloc::sample(ptrs[i]), SizeClass::index(64));
+            sampled++;
+        }
+    }
+    ASSERT_EQ(HeapProfiler::samples() - before, sampled);
+    ASSERT_TRUE(sampled > 5 && sampled < 100);
+
+    // One line per sample, each weighing about a sampling interval.
+    FILE* file = tmpfile();
+    ASSERT_EQ(myMallocProfileDump(fileno(file)), HeapProfiler::samples());
+    rewind(file);
+    char line[8192];
+    size_t lines = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        char* weight = strrchr(line, ' ');
+        ASSERT_TRUE(weight != nullptr);
+        ASSERT_TRUE(strtoul(weight + 1, nullptr, 10) >= 64);
+        lines++;
+    }
+    fclose(file);
+    ASSERT_EQ(lines, HeapProfiler::samples());
+
+    // BigAllocs are nearly always sampled at this rate, and marked as such.
+    void* big = myMalloc(1 << 20);
+    ASSERT_EQ(BigAlloc::sample(big), BigAlloc::sampledBig);
+    ASSERT_TRUE(HeapProfiler::sampled(big));
+    myFree(big);
+    ASSERT_EQ(HeapProfiler::samples() - before, sampled);
+
+    // Requests bound to fail are neither sampled nor counted down, so one past
+    // INT64_MAX doesn't push the next sample out of reach.
+    ASSERT_TRUE(myMalloc(size_t(3) << 62) == nullptr);
+    ASSERT_EQ(HeapProfiler::samples() - before, sampled);
+    void* more[count];
+    for (size_t i = 0; i < count; i++) {
+        more[i] = myMalloc(64);
+    }
+    ASSERT_TRUE(HeapProfiler::samples() - before > sampled + 5);
+    for (void* ptr : more) {
+        myFree(ptr);
+    }
+    ASSERT_EQ(HeapProfiler::samples() - before, sampled);
+    myMallocSetSampleRate(0);
+    big = myMalloc(1 << 20);
+    ASSERT_EQ(BigAlloc::sample(big), BigAlloc::unsampled);
+    myFree(big);
+
+    myMallocSetSampleRate(MALLOC_SAMPLE_BYTES);
+    for (size_t i = 0; i < count; i++) {
+        ASSERT_EQ(*(unsigned char*)ptrs[i], (unsigned char)i);
+        myFree(ptrs[i]);
+    }
+    ASSERT_EQ(HeapProfiler::samples(), before);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void tracesRecordEveryCall() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mymalloc-trace-%d", (int)getpid());
+    ASSERT_TRUE(myMallocTraceStart(path, 64));
+    ASSERT_TRUE(!myMallocTraceStart(path, 64));
+
+    void* a = myMalloc(24);
+    void* b = myRealloc(myMalloc(100), 2000);
+    std::thread([a] { myFree(a); }).join();
+    void* batch[3];
+    ASSERT_EQ(myMallocBatch(8, 3, batch), 3);
+    myFreeBatch(batch, 3);
+    myFree(b);
+    myMallocTraceStop();
+    // Untraced.
+    myFree(myMalloc(8));
+
+    Trace::Reader trace;
+    ASSERT_TRUE(trace.open(path));
+    unlink(path);
+    ASSERT_EQ(trace.count(), 12);
+    ASSERT_TRUE(!trace.wrapped());
+    const uint8_t ops[] = {
+        Trace::Malloc, Trace::Malloc, Trace::ReallocFrom, Trace::ReallocTo, Trace::Free,
+        Trace::Malloc, Trace::Malloc, Trace::Malloc, Trace::Free, Trace::Free, Trace::Free, Trace::Free,
+    };
+    size_t i = 0;
+    for (size_t e = 0; e < trace.count(); e++) {
+        if (trace[e].op == Trace::None) {
+            continue;
+        }
+        ASSERT_EQ(trace[e].op, ops[i++]);
+    }
+    ASSERT_EQ(i, sizeof(ops));
+    ASSERT_EQ(trace[0].object, (uintptr_t)a);
+    ASSERT_EQ(trace[0].size, 24);
+    ASSERT_EQ(trace[3].object, (uintptr_t)b);
+    ASSERT_EQ(trace[3].size, 2000);
+    // The other thread's free, then this thread again.
+    ASSERT_TRUE(trace[4].thread != trace[0].thread);
+    ASSERT_EQ(trace[4].object, (uintptr_t)a);
+    ASSERT_EQ(trace[5].thread, trace[0].thread);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void idleThreadsMemoryDecaysInTheBackground() {
+    auto churn = [] {
+        std::vector<void*> items;
+        for (int i = 0; i < 1000; i++) {
+            items.push_back(myMalloc(64));
+        }
+        for (void* item : items) {
+            myFree(item);
+        }
+    };
+    // The thread's emptied arenas stay cached in its store while it sits idle.
+    std::atomic<bool> churned(false);
+    std::atomic<bool> done(false);
+    std::thread idle([&] {
+        churn();
+        churned = true;
+        while (!done) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        myMallocCollect();
+    });
+    while (!churned) {
+        std::this_thread::yield();
+    }
+    size_t cached = MMapObject::outstandingPages();
+
+    ASSERT_TRUE(myMallocBackgroundPurge(true));
+    ASSERT_TRUE(myMallocBackgroundPurge(true));
+    for (int i = 0; i < 100 && (MMapObject::outstandingPages() >= cached || PageReserve::dirtyPages() > 0); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    ASSERT_TRUE(myMallocBackgroundPurge(false));
+    ASSERT_TRUE(MMapObject::outstandingPages() < cached);
+    ASSERT_EQ(PageReserve::dirtyPages(), 0);
+    done = true;
+    idle.join();
+
+    // Trimming doesn't wait for anything to decay.
+    churn();
+    ASSERT_TRUE(myMallocTrim() > 0);
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+    ASSERT_EQ(PageReserve::dirtyPages(), 0);
+}
+
+void exitedThreadsStoresAreReused() {
+    size_t pages = MMapObject::outstandingPages();
+    ArenaStore* exited = nullptr;
+    void* kept = nullptr;
+    std::thread([&] {
+        std::vector<void*> items;
+        for (int i = 0; i < 1000; i++) {
+            items.push_back(myMalloc(64));
+        }
+        for (void* item : items) {
+            myFree(item);
+        }
+        kept = myMalloc(64);
+        exited = ArenaStore::local();
+    }).join();
+
+    // Exiting released everything but the arena still in use...
+    ASSERT_EQ(MMapObject::outstandingPages(), pages + SizeClass::spanPages(SizeClass::index(64)));
+
+    // ...which the next thread takes over with the store.
+    ArenaStore* adopted = nullptr;
+    std::thread([&] {
+        adopted = ArenaStore::local();
+        myFree(kept);
+        myMallocCollect();
+    }).join();
+    ASSERT_EQ(adopted, exited);
+    ASSERT_EQ(MMapObject::outstandingPages(), pages);
+}
+
+void emptyArenaCacheGrowsWithMisses() {
+    std::thread([] {
+        ArenaStore* store = ArenaStore::local();
+        size_t sizeClass = SizeClass::index(48);
+        size_t count = SizeClass::slotsPerSpan(sizeClass);
+        ASSERT_EQ(store->emptyLimit(sizeClass), 1);
+
+        // Each round empties a few arenas at once and then needs them back.
+        std::vector<void*> ptrs;
+        for (int round = 0; round < 8; round++) {
+            for (size_t i = 0; i < 6 * count; i++) {
+                ptrs.push_back(myMalloc(48));
+            }
+            for (void* ptr : ptrs) {
+                myFree(ptr);
+            }
+            ptrs.clear();
+        }
+        ASSERT_EQ(store->emptyLimit(sizeClass), ArenaStore::emptyArenaCacheSize);
+
+        // Once the cached arenas decay unused the cache shrinks back.
+        std::this_thread::sleep_for(std::chrono::milliseconds(ArenaStore::decayMillis + 100));
+        store->purgeCaches(false);
+        ASSERT_EQ(store->emptyLimit(sizeClass), 1);
+    }).join();
+}
+
+void remoteFreesAreHandedBackInBatches() {
+    size_t sizeClass = SizeClass::index(64);
+    size_t batch = ArenaStore::transferBatch;
+    size_t slots = SizeClass::slotsPerSpan(sizeClass);
+    size_t pages = MMapObject::outstandingPages();
+    std::vector<void*> all;
+    for (size_t i = 0; i < 2 * slots; i++) {
+        all.push_back(myMalloc(64));
+    }
+    // Enough of them come from one arena to make a batch.
+    void* arena = MMapObject::fromPointer(all[slots]);
+    std::vector<void*> ptrs;
+    for (void* ptr : all) {
+        if (MMapObject::fromPointer(ptr) == arena && ptrs.size() < batch + 3) {
+            ptrs.push_back(ptr);
+        }
+        else {
+            myFree(ptr);
+        }
+    }
+    ASSERT_EQ(ptrs.size(), batch + 3);
+    std::vector<void*> others;
+    for (size_t i = 0; i < 2 * ArenaStore::transferAge; i++) {
+        others.push_back(myMalloc(16));
+    }
+
+    std::thread([&] {
+        ArenaStore* store = ArenaStore::local();
+        for (size_t i = 0; i < batch - 1; i++) {
+            myFree(ptrs[i]);
+        }
+        ASSERT_EQ(store->pendingTransfers(sizeClass), batch - 1);
+        // The batch goes back with its last free...
+        myFree(ptrs[batch - 1]);
+        ASSERT_EQ(store->pendingTransfers(sizeClass), 0);
+        // ...and a partial one when the thread leaves its fast path...
+        myFree(ptrs[batch]);
+        ASSERT_EQ(store->pendingTransfers(sizeClass), 1);
+        myFree(myMalloc(1 << 20));
+        ASSERT_EQ(store->pendingTransfers(sizeClass), 0);
+        // ...or once it has gone on freeing other items for long enough...
+        myFree(ptrs[batch + 1]);
+        for (void* ptr : others) {
+            myFree(ptr);
+        }
+        ASSERT_EQ(store->pendingTransfers(sizeClass), 0);
+        // ...or collects.
+        myFree(ptrs[batch + 2]);
+        ASSERT_EQ(store->pendingTransfers(sizeClass), 1);
+        myMallocCollect();
+        ASSERT_EQ(store->pendingTransfers(sizeClass), 0);
+    }).join();
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), pages);
+}
+
+void walksEveryLiveItem() {
+    std::thread([] {
+        std::map<void*, size_t> expected;
+        std::vector<void*> freed;
+        for (size_t i = 0; i < 2000; i++) {
+            size_t size = 8 + i % 300;
+            void* ptr = myMalloc(size);
+            if (i % 4 == 0) {
+                freed.push_back(ptr);
+            }
+            else {
+                expected[ptr] = SizeClass::size(SizeClass::index(size));
+            }
+        }
+        for (void* ptr : freed) {
+            myFree(ptr);
+        }
+
+        std::map<void*, size_t> walked;
+        size_t count = myMallocWalkLive([](void* ptr, size_t size, void* arg) {
+            (*static_cast<std::map<void*, size_t>*>(arg))[ptr] = size;
+        }, &walked);
+        ASSERT_EQ(count, walked.size());
+        // Sampled items are BigAllocs, which aren't walked.
+        ASSERT_TRUE(walked.size() + HeapProfiler::samples() >= expected.size());
+        for (auto& item : walked) {
+            ASSERT_EQ(expected.count(item.first), 1);
+            ASSERT_EQ(expected[item.first], item.second);
+        }
+        for (auto& item : expected) {
+            myFree(item.first);
+        }
+        ASSERT_EQ(myMallocWalkLive([](void*, size_t, void*) {}, nullptr), 0);
+    }).join();
+}
+
+/**
+ * Runs `body` in a child process with its stderr thrown away, and returns the
+ * signal that killed it, or zero if it exited.
+ */
+int signalFrom(void (*body)()) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        body();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+void hardenedModeCatchesBadFrees() {
+    if (!MallocPolicy::hardened) {
+        return;
+    }
+    // Freeing the same item twice.
+    ASSERT_EQ(signalFrom([] {
+        void* ptr = myMalloc(32);
+        myFree(ptr);
+        myFree(ptr);
+    }), SIGTRAP);
+
+    // The same from another thread, which is caught when the owner collects.
+    ASSERT_EQ(signalFrom([] {
+        void* ptr = myMalloc(32);
+        std::thread([ptr] {
+            myFree(ptr);
+            myMallocCollect();
+            myFree(ptr);
+            myMallocCollect();
+        }).join();
+        myMallocCollect();
+    }), SIGTRAP);
+
+    // A pointer into the middle of an item.
+    ASSERT_EQ(signalFrom([] {
+        char* ptr = static_cast<char*>(myMalloc(64));
+        myFree(ptr + 8);
+    }), SIGTRAP);
+
+    // A pointer we never handed out.
+    ASSERT_EQ(signalFrom([] {
+        static char notOurs[64];
+        myFree(notOurs);
+    }), SIGTRAP);
+
+    // Freeing an item again once it's been handed back out is fine.
+    void* ptr = myMalloc(32);
+    myFree(ptr);
+    ASSERT_TRUE(myMalloc(32) == ptr);
+    myFree(ptr);
+}
+
+void hardenedModeCatchesOverflows() {
+    if (!MallocPolicy::hardened) {
+        return;
+    }
+    // Overwriting a freed item's link to the next free one.
+    ASSERT_EQ(signalFrom([] {
+        void* first = myMalloc(48);
+        void* second = myMalloc(48);
+        myFree(first);
+        myFree(second);
+        static char target[64];
+        *static_cast<char**>(second) = target;
+        myMalloc(48);
+        myMalloc(48);
+    }), SIGTRAP);
+
+    // Changing one byte past the end of a BigAlloc hits its canary. (Writing
+    // a fixed value would leave it intact whenever the byte already held it.)
+    ASSERT_EQ(signalFrom([] {
+        char* ptr = static_cast<char*>(myMalloc(100'000));
+        ptr[BigAlloc::size(ptr)] ^= 1;
+        myFree(ptr);
+    }), SIGTRAP);
+
+    // And a write past its canary into the guard page faults, for BigAllocs
+    // mapped on their own.
+    ASSERT_EQ(signalFrom([] {
+        char* ptr = static_cast<char*>(myMalloc(maxMediumPages * pageSize * 2));
+        ptr[BigAlloc::size(ptr) + BigAlloc::canaryBytes] = 1;
+    }), SIGSEGV);
+
+    // Intact canaries pass, even after a realloc moves or resizes the BigAlloc.
+    char* ptr = static_cast<char*>(myMalloc(100'000));
+    memset(ptr, 1, BigAlloc::size(ptr));
+    ptr = static_cast<char*>(myRealloc(ptr, 300'000));
+    memset(ptr, 1, BigAlloc::size(ptr));
+    myFree(ptr);
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void forkedChildrenCanAllocate() {
+    pthread_atfork(myMallocPrepareFork, myMallocParentAfterFork, myMallocChildAfterFork);
+
+    // Another thread keeps taking the reserve's, the profiler's and its own
+    // store's locks while we fork; each child must still get memory.
+    std::atomic<bool> done(false);
+    std::thread churn([&done] {
+        while (!done.load()) {
+            myFree(myMalloc(5000));
+            myFree(myMalloc(1 << 20));
+            myMallocTrim();
+        }
+    });
+    for (int i = 0; i < 20; i++) {
+        ASSERT_EQ(signalFrom([] {
+            alarm(10);
+            void* ptr = myMalloc(5000);
+            myFree(ptr);
+            myMallocTrim();
+        }), 0);
+    }
+    done = true;
+    churn.join();
+}
+
+void freedMediumSpansStayWithTheStore() {
+    myMallocCollect();
+    auto ptr = static_cast<char*>(myMalloc(5 * pageSize - 200));
+    memset(ptr, 1, 5 * pageSize - 200);
+    size_t dirty = PageReserve::dirtyPages();
+    size_t outstanding = MMapObject::outstandingPages();
+
+    // A freed medium block stays mapped with its store instead of going back
+    // to the reserve...
+    myFree(ptr);
+    ASSERT_EQ(PageReserve::dirtyPages(), dirty);
+    ASSERT_EQ(MMapObject::outstandingPages(), outstanding);
+    ASSERT_EQ(BigAlloc::sample(ptr), BigAlloc::cachedSpan);
+
+    // ...and comes back, cleared if asked, for anything with as many pages.
+    auto again = static_cast<char*>(myCalloc(1, 5 * pageSize - 100));
+    ASSERT_TRUE(again == ptr);
+    for (size_t i = 0; i < 5 * pageSize - 100; i++) {
+        ASSERT_EQ(again[i], 0);
+    }
+    myFree(again);
+
+    // Freeing one twice is caught.
+    ASSERT_EQ(signalFrom([] {
+        void* ptr = myMalloc(3 * pageSize);
+        myFree(ptr);
+        myFree(ptr);
+    }), SIGTRAP);
+
+    // Spans past the cache's pages go straight back.
+    myMallocCollect();
+    constexpr size_t count = MallocPolicy::spanCachePages / 8 + 1;
+    void* spans[count];
+    for (size_t i = 0; i < count; i++) {
+        spans[i] = myMalloc(8 * pageSize - 100);
+    }
+    outstanding = MMapObject::outstandingPages();
+    for (size_t i = 0; i < count; i++) {
+        myFree(spans[i]);
+    }
+    ASSERT_EQ(MMapObject::outstandingPages(), outstanding - 1);
+
+    myMallocCollect();
+    ASSERT_EQ(MMapObject::outstandingPages(), 0);
+}
+
+void freesPastTheDirtyLimitAreCheap() {
+    constexpr size_t count = PageReserve::maxDirtyPages + 1;
+    static void* spans[count];
+    PageReserve::decommit();
+    for (size_t i = 0; i < count; i++) {
+        spans[i] = PageReserve::allocSpan(1);
+        ASSERT_TRUE(spans[i] != nullptr);
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        PageReserve::freeSpan(spans[i], 1);
+    }
+    size_t dirty = PageReserve::dirtyPages();
+    ASSERT_EQ(dirty, PageReserve::maxDirtyPages);
+
+    // Only the span over the limit is given back, not every dirty one.
+    size_t syscalls = PageReserve::syscalls();
+    PageReserve::freeSpan(spans[count - 1], 1);
+    ASSERT_EQ(PageReserve::dirtyPages(), dirty);
+    ASSERT_TRUE(PageReserve::syscalls() - syscalls <= 2);
+
+    ASSERT_EQ(PageReserve::decommit(), dirty);
+    ASSERT_EQ(PageReserve::dirtyPages(), 0);
+}
+
+void reserveSplitsSpansButNeverMergesThem() {
+    // This uses up the reservation, so it runs in a child.
+    ASSERT_EQ(signalFrom([] {
+        // Use up the slice, then every free span left over.
+        void* four = nullptr;
+        while (void* span = PageReserve::allocSpan(4)) {
+            four = span;
+        }
+        while (PageReserve::allocSpan(1) != nullptr) {
+        }
+        ASSERT_TRUE(four != nullptr);
+
+        // A freed span is split for smaller requests...
+        char* start = static_cast<char*>(four);
+        PageReserve::freeSpan(four, 4);
+        ASSERT_TRUE(PageReserve::allocSpan(1) == start);
+        ASSERT_TRUE(PageReserve::allocSpan(2) == start + pageSize);
+        ASSERT_TRUE(PageReserve::allocSpan(1) == start + 3 * pageSize);
+        ASSERT_TRUE(PageReserve::allocSpan(1) == nullptr);
+
+        // ...but free neighbours are never merged for a bigger one.
+        PageReserve::freeSpan(start + pageSize, 2);
+        PageReserve::freeSpan(start + 3 * pageSize, 1);
+        ASSERT_TRUE(PageReserve::allocSpan(3) == nullptr);
+    }), 0);
+}
+
 void canMallocAndFreeABunchOfStuff() {
     // Scope the vectors so they'll destruct and clear their underlying data.
     {
@@ -219,8 +1603,11 @@ void canMallocAndFreeABunchOfStuff() {
         }
     }
 
-    // Number of outstanding pages should be less than 8 (no more than one per arena)
-    ASSERT_TRUE(MMapObject::outstandingPages() <= 8);
+    // Emptied arenas are cached until they decay or we collect them.
+    myMallocCollect();
+
+    // Number of outstanding pages should be no more than one per size class
+    ASSERT_TRUE(MMapObject::outstandingPages() <= SizeClass::count);
 }
 
 void canMallocAndFreeABunchOfStuffThreaded() {
@@ -287,20 +1674,135 @@ void canMallocAndFreeABunchOfStuffThreaded() {
         while (doneThreads.load() < nThreads) { }
     }
 
-    // Number of outstanding pages should be less than 8 (no more than one per arena)
-    ASSERT_TRUE(MMapObject::outstandingPages() <= 8);
+    // The other threads' frees are handed back to this thread lazily.
+    myMallocCollect();
+
+    // Number of outstanding pages should be no more than one per size class
+    ASSERT_TRUE(MMapObject::outstandingPages() <= SizeClass::count);
+}
+
+void threadsAllocateFromTheirOwnArenas() {
+    void* mine = myMalloc(16);
+    void* theirs = nullptr;
+
+    std::thread([&]() {
+        theirs = myMalloc(16);
+    }).join();
+
+    ASSERT_TRUE(mine != nullptr);
+    ASSERT_TRUE(theirs != nullptr);
+
+    auto myArena = static_cast<Arena*>(MMapObject::fromPointer(mine));
+    auto theirArena = static_cast<Arena*>(MMapObject::fromPointer(theirs));
+
+    ASSERT_TRUE(myArena != theirArena);
+    ASSERT_TRUE(myArena->owner() == ArenaStore::local());
+    ASSERT_TRUE(theirArena->owner() != ArenaStore::local());
+
+    myFree(theirs);
+    myFree(mine);
+}
+
+void crossThreadFreesReturnToOwner() {
+    size_t count = 2 * expectedArenaAllocations(64);
+    std::vector<void*> addresses;
+
+    // Fill at least one whole arena so it is retired from the store.
+    for (size_t i = 0; i < count; i++) {
+        addresses.push_back(myMalloc(64));
+    }
+
+    size_t pages = MMapObject::outstandingPages();
+    const ArenaStore::ClassStats& stats = ArenaStore::local()->stats().classes[SizeClass::index(64)];
+    uint64_t released = stats.arenasReleased.load();
+
+    std::thread([&]() {
+        for (auto ptr : addresses) {
+            myFree(ptr);
+        }
+    }).join();
+
+    // The frees are pending on this thread's store until it collects them. (The
+    // other thread's exit may have released arenas of its own.)
+    ASSERT_EQ(stats.arenasReleased.load(), released);
+
+    myMallocCollect();
+
+    ASSERT_TRUE(stats.arenasReleased.load() > released);
+    ASSERT_TRUE(MMapObject::outstandingPages() < pages);
+}
+
+void freesWithoutAStoreReachTheOwner() {
+    size_t count = 2 * expectedArenaAllocations(64);
+    std::vector<void*> addresses;
+    for (size_t i = 0; i < count; i++) {
+        addresses.push_back(myMalloc(64));
+    }
+    void* big = myMalloc(1 << 20);
+    size_t pages = MMapObject::outstandingPages();
+
+    // A thread that couldn't map a store of its own hands items straight back
+    // to their owner, and unmaps BigAllocs itself.
+    std::thread([&]() {
+        for (auto ptr : addresses) {
+            ArenaStore::freeWithoutStore(ptr);
+        }
+        ArenaStore::freeWithoutStore(big);
+    }).join();
+    ASSERT_EQ(MMapObject::outstandingPages(), pages - 1);
+
+    myMallocCollect();
+    ASSERT_TRUE(MMapObject::outstandingPages() < pages - 1);
 }
 
 int runMallocTests() {
     TestSuite suite;
 
     TEST(suite, canAllocateBigObject);
+    TEST(suite, oversizedRequestsFail);
     TEST(suite, mmapObjectHasCorrectSize);
     TEST(suite, arenaHasCorrectSize);
     TEST(suite, canAllocCorrectNumberOfBlocks);
     TEST(suite, canFreeCorrectNumberOfBlocks);
+    TEST(suite, arenaReusesFreedSlots);
+    TEST(suite, remoteFreesAreCollectedInOneBatch);
+    TEST(suite, slotBitmapTracksLiveItems);
+    TEST(suite, sizeClassIsSmallestFit);
+    TEST(suite, largeClassesSpanMultiplePages);
+    TEST(suite, storesFollowTheirPolicy);
+    TEST(suite, pageMapFindsEverySpan);
+    TEST(suite, arenasComeFromTheReservation);
+    TEST(suite, spansGoBackToTheirNode);
+    TEST(suite, zeroSpansReadAsZero);
+    TEST(suite, mediumAllocationsReuseFreedRegions);
+    TEST(suite, reallocKeepsContents);
+    TEST(suite, callocClearsRecycledMemory);
+    TEST(suite, alignedAllocationsAreAligned);
+    TEST(suite, sizedFreesFindTheirArena);
+    TEST(suite, batchesFillWholeArenas);
+    TEST(suite, regionsBumpAndResetAtOnce);
+    TEST(suite, objectPoolsRecycleSlots);
+    TEST(suite, cacheAlignedAllocationsDontShareLines);
+    TEST(suite, statsCountEveryAllocation);
+    TEST(suite, heapProfileSamplesAllocations);
+    TEST(suite, tracesRecordEveryCall);
+    TEST(suite, idleThreadsMemoryDecaysInTheBackground);
+    TEST(suite, exitedThreadsStoresAreReused);
+    TEST(suite, emptyArenaCacheGrowsWithMisses);
+    TEST(suite, remoteFreesAreHandedBackInBatches);
+    TEST(suite, walksEveryLiveItem);
+    TEST(suite, hardenedModeCatchesBadFrees);
+    TEST(suite, hardenedModeCatchesOverflows);
+    TEST(suite, forkedChildrenCanAllocate);
+    TEST(suite, freedMediumSpansStayWithTheStore);
+    TEST(suite, freesPastTheDirtyLimitAreCheap);
+    TEST(suite, reserveSplitsSpansButNeverMergesThem);
     TEST(suite, canMallocAndFreeABunchOfStuff);
     TEST(suite, canMallocAndFreeABunchOfStuffThreaded);
+    TEST(suite, emptyArenasAreCachedForReuse);
+    TEST(suite, threadsAllocateFromTheirOwnArenas);
+    TEST(suite, crossThreadFreesReturnToOwner);
+    TEST(suite, freesWithoutAStoreReachTheOwner);
 
     rusage resourseUsage;
 